@@ -47,6 +47,13 @@
 #include <linux/platform_device.h>
 #include <linux/acpi.h>
 #include <linux/dmi.h>
+#include <linux/semaphore.h>
+#include <linux/kfifo.h>
+#include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/kernel_stat.h>
 
 #include <linux/version.h>
 #if LINUX_VERSION_CODE > KERNEL_VERSION(5,6,0)
@@ -66,6 +73,12 @@ static inline long deci_kelvin_to_millicelsius(long t)
 }
 #endif
 
+#if IS_ENABLED(CONFIG_LEDS_CLASS_MULTICOLOR) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+#include <linux/led-class-multicolor.h>
+#define ASUS_KBBL_LED_MC
+#endif
+
 #include <acpi/battery.h>
 #include <acpi/video.h>
 
@@ -84,6 +97,119 @@ static bool report_key_events = 0;
 module_param(report_key_events, bool, 0644);
 MODULE_PARM_DESC(report_key_events, "Forward fan mode key events");
 
+static uint dsts_ttl_sensor = 1000;
+module_param(dsts_ttl_sensor, uint, 0644);
+MODULE_PARM_DESC(dsts_ttl_sensor,
+		 "DSTS cache lifetime for fan and thermal readings in ms (0 - off)");
+
+static uint dsts_ttl_light = 2000;
+module_param(dsts_ttl_light, uint, 0644);
+MODULE_PARM_DESC(dsts_ttl_light,
+		 "DSTS cache lifetime for LED and backlight state in ms (0 - off)");
+
+static uint dsts_ttl_misc = 2000;
+module_param(dsts_ttl_misc, uint, 0644);
+MODULE_PARM_DESC(dsts_ttl_misc,
+		 "DSTS cache lifetime for other devices in ms (0 - off)");
+
+static bool ec_fast_path = 1;
+module_param(ec_fast_path, bool, 0444);
+MODULE_PARM_DESC(ec_fast_path,
+		 "Read fan speed and CPU temperature from the EC when possible");
+
+/* EC offsets are bytes, -1 stands for the model default */
+static int param_set_ec_reg(const char *val, const struct kernel_param *kp,
+			    int last)
+{
+	int reg, err;
+
+	err = kstrtoint(val, 0, &reg);
+	if (err)
+		return err;
+
+	if (reg < -1 || reg > last)
+		return -EINVAL;
+
+	*(int *)kp->arg = reg;
+	return 0;
+}
+
+static int param_set_ec_reg8(const char *val, const struct kernel_param *kp)
+{
+	return param_set_ec_reg(val, kp, 0xff);
+}
+
+/* Two byte values also need the offset after the given one */
+static int param_set_ec_reg16(const char *val, const struct kernel_param *kp)
+{
+	return param_set_ec_reg(val, kp, 0xfe);
+}
+
+static const struct kernel_param_ops param_ops_ec_reg8 = {
+	.set = param_set_ec_reg8,
+	.get = param_get_int,
+};
+
+static const struct kernel_param_ops param_ops_ec_reg16 = {
+	.set = param_set_ec_reg16,
+	.get = param_get_int,
+};
+
+static int ec_fan_rpm_reg = -1;
+module_param_cb(ec_fan_rpm_reg, &param_ops_ec_reg16, &ec_fan_rpm_reg, 0444);
+MODULE_PARM_DESC(ec_fan_rpm_reg,
+		 "EC offset of the 16 bit fan RPM, high byte first (-1 - model default)");
+
+static int ec_cpu_temp_reg = -1;
+module_param_cb(ec_cpu_temp_reg, &param_ops_ec_reg8, &ec_cpu_temp_reg, 0444);
+MODULE_PARM_DESC(ec_cpu_temp_reg,
+		 "EC offset of the CPU temperature in degrees C (-1 - model default)");
+
+static uint hotkey_coalesce_ms = 50;
+module_param(hotkey_coalesce_ms, uint, 0644);
+MODULE_PARM_DESC(hotkey_coalesce_ms,
+		 "Merge brightness hotkey repeats within this window in ms (0 - off)");
+
+static uint led_min_interval_ms = 50;
+module_param(led_min_interval_ms, uint, 0644);
+MODULE_PARM_DESC(led_min_interval_ms,
+		 "Default minimum time between two writes to one LED in ms");
+
+static uint kbbl_persist_delay_ms;
+module_param(kbbl_persist_delay_ms, uint, 0644);
+MODULE_PARM_DESC(kbbl_persist_delay_ms,
+		 "Show saved RGB keyboard settings at once, save them after "
+		 "this quiet period in ms (0 - save immediately)");
+
+static uint idle_timeout;
+module_param(idle_timeout, uint, 0644);
+MODULE_PARM_DESC(idle_timeout,
+		 "Dim the keyboard lights after this many seconds without "
+		 "input (0 - never)");
+
+static uint idle_kbd_level;
+module_param(idle_kbd_level, uint, 0644);
+MODULE_PARM_DESC(idle_kbd_level,
+		 "Keyboard backlight level while idle (default 0 - off)");
+
+static uint idle_rgb_percent;
+module_param(idle_rgb_percent, uint, 0644);
+MODULE_PARM_DESC(idle_rgb_percent,
+		 "RGB keyboard brightness in percent while idle (default 0 - off)");
+
+static bool async_writes = 0;
+module_param(async_writes, bool, 0644);
+MODULE_PARM_DESC(async_writes,
+		 "Return from sysfs stores at once and apply them from a worker");
+
+/* 0xPPSSCC: optional 0xe0 prefix, make scancode, WMI event code */
+static uint i8042_hotkeys[8];
+static int i8042_hotkeys_num;
+module_param_array(i8042_hotkeys, uint, &i8042_hotkeys_num, 0444);
+MODULE_PARM_DESC(i8042_hotkeys,
+		 "Handle these Fn scancodes at the keyboard, as 0xPPSSCC: "
+		 "prefix (0 or e0), scancode, WMI event code");
+
 #define ASUS_WMI_MGMT_GUID	"97845ED0-4E6D-11DE-8A39-0800200C9A66"
 
 #define NOTIFY_BRNUP_MIN		0x11
@@ -111,6 +237,12 @@ MODULE_PARM_DESC(report_key_events, "Forward fan mode key events");
 #define ASUS_FAN_CTRL_MANUAL		1
 #define ASUS_FAN_CTRL_AUTO		2
 
+/* Largest EC vs WMI difference accepted by the probe time self-check */
+#define ASUS_EC_FAN_RPM_TOLERANCE	300
+/* Reads of the RPM high byte before giving up on a stable value */
+#define ASUS_EC_FAN_RPM_TRIES		3
+#define ASUS_EC_TEMP_TOLERANCE		3000	/* millidegrees */
+
 #define ASUS_FAN_BOOST_MODE_NORMAL		0
 #define ASUS_FAN_BOOST_MODE_OVERBOOST		1
 #define ASUS_FAN_BOOST_MODE_OVERBOOST_MASK	0x01
@@ -181,8 +313,27 @@ struct agfn_fan_args {
  *   ctrl_param  - current ctrl_param
  *   method_id   - current method_id
  *   devs        - call DEVS(dev_id, ctrl_param) and print result
- *   dsts        - call DSTS(dev_id)  and print result
+ *   dsts        - call DSTS(dev_id)  and print result (bypasses the cache)
  *   call        - call method_id(dev_id, ctrl_param) and print result
+ *   dsts_cache_hits   - DSTS reads served from the cache
+ *   dsts_cache_misses - DSTS reads that went to the firmware
+ *   call_buf_overflows - WMI results that did not fit the call buffer
+ *   devs_issued - DEVS writes sent to the firmware
+ *   devs_skipped - DEVS writes dropped as identical to the last one
+ *   event_ring_max_depth - most events ever waiting to be handled
+ *   event_ring_overflows - events dropped because the ring was full
+ *   i8042_handled - hotkeys taken from the keyboard by the i8042 filter
+ *   i8042_deduped - WMI events dropped as already seen at the keyboard
+ *   kbbl_persistent_writes - RGB keyboard calls that saved the setting
+ *   kbbl_temporary_writes - RGB keyboard calls that only showed it
+ *   event_latency - per event code latency of each handling stage
+ *   inject      - write event codes to run them through the event ring,
+ *                 "stop" ends a run; read for the result of the last run
+ *   inject_rate - events per second injected, 0 - as fast as possible
+ *   inject_count - events per run, cycling through the codes, 0 - once each
+ *   sched       - WMI calls, waits and longest wait per priority class
+ *   devices     - DSTS of every known device id as seen at probe
+ *   dsts_all    - current DSTS of every readable device id, read in one batch
  */
 struct asus_wmi_debug {
 	struct dentry *root;
@@ -197,12 +348,61 @@ struct asus_rfkill {
 	u32 dev_id;
 };
 
+/* Payload of one RGB DEVS call, without the persistence marker */
+struct asus_kbbl_payload {
+	u32 arg[2];
+	bool valid;
+};
+
+enum {
+	ASUS_KBBL_RGB = 0,	/* ASUS_WMI_DEVID_KBD_RGB: colour, mode, speed */
+	ASUS_KBBL_RGB2,		/* ASUS_WMI_DEVID_KBD_RGB2: flags */
+	ASUS_KBBL_CALLS,
+};
+
+/* Async kbbl value committing kbbl_rgb.async_state, 1 and 2 are kbbl_set's */
+#define ASUS_KBBL_ASYNC_STATE	3
+
+/* Attempts to save a deferred commit before it is given up */
+#define ASUS_KBBL_PERSIST_RETRIES	3
+
+/* Lit while awake, on boot and asleep when nothing else was chosen */
+#define ASUS_KBBL_FLAGS_DEFAULT	0x2a
+
+/* Data a trigger maps onto the keyboard colour */
+enum asus_kbbl_source {
+	ASUS_KBBL_SOURCE_NONE = 0,	/* colour set by the user */
+	ASUS_KBBL_SOURCE_CPUTEMP,	/* degrees Celsius */
+	ASUS_KBBL_SOURCE_CPULOAD,	/* percent busy over all CPUs */
+	ASUS_KBBL_SOURCE_BATTERY,	/* percent charged */
+	ASUS_KBBL_SOURCE_COUNT,
+};
+
 struct asus_kbbl_rgb {
+	struct mutex lock;	/* kbbl_set_* and their commit */
+	enum asus_kbbl_source source;	/* any other commit resets it */
+
+	/* Last payloads shown and saved, only changed ones are sent */
+	struct asus_kbbl_payload shown[ASUS_KBBL_CALLS];
+	struct asus_kbbl_payload saved[ASUS_KBBL_CALLS];
+	u32 persistent_writes;
+	u32 temporary_writes;
+
+	/* Saving deferred by kbbl_persist_delay_ms */
+	struct delayed_work persist_work;
+	struct asus_kbbl_state persist_state;
+	bool persist_pending;
+	u8 persist_retries;
+
+	/* Last kbbl_state queued with async_writes */
+	struct asus_kbbl_state async_state;
+
 	u8 kbbl_red;
 	u8 kbbl_green;
 	u8 kbbl_blue;
 	u8 kbbl_mode;
 	u8 kbbl_speed;
+	u8 kbbl_flags;
 
 	u8 kbbl_set_red;
 	u8 kbbl_set_green;
@@ -212,6 +412,466 @@ struct asus_kbbl_rgb {
 	u8 kbbl_set_flags;
 };
 
+/*
+ * Keyframe animation of the RGB keyboard. Every frame is a temporary
+ * commit; the frame rate follows the measured commit time.
+ */
+#define ASUS_KBBL_ANIM_FRAMES	16
+#define ASUS_KBBL_ANIM_MAX_FPS	30
+#define ASUS_KBBL_ANIM_MAX_MS	60000	/* per keyframe, keeps the sums in u32 */
+
+enum asus_kbbl_easing {
+	ASUS_KBBL_EASE_LINEAR = 'l',
+	ASUS_KBBL_EASE_IN = 'i',
+	ASUS_KBBL_EASE_OUT = 'o',
+	ASUS_KBBL_EASE_IN_OUT = 's',
+	ASUS_KBBL_EASE_HOLD = 'h',
+};
+
+/* Fades from this colour to the next keyframe's over duration_ms */
+struct asus_kbbl_keyframe {
+	u8 red;
+	u8 green;
+	u8 blue;
+	u8 easing;
+	u32 duration_ms;
+};
+
+struct asus_kbbl_anim {
+	struct hrtimer timer;
+	struct work_struct work;
+	struct asus_kbbl_keyframe frame[ASUS_KBBL_ANIM_FRAMES];
+	int n;
+	u32 total_ms;
+	bool running;
+	ktime_t start;
+
+	u32 frames;
+	u32 write_us;		/* running average of one firmware commit */
+	u32 period_us;
+};
+
+/* Keyboard lights dimmed after idle_timeout without input */
+struct asus_wmi_idle {
+	struct input_handler handler;
+	bool registered;
+	struct mutex lock;		/* dimming and restoring */
+	struct delayed_work dim_work;
+	struct work_struct restore_work;
+	unsigned long last_input;	/* jiffies */
+	bool dimmed;
+
+	/* What was shown before dimming, and the dimmed colour */
+	int kbd_level;
+	bool rgb_dimmed;
+	struct asus_kbbl_payload rgb_before;
+	struct asus_kbbl_payload rgb_dim;
+};
+
+/* Colour gradient over the value of a trigger source */
+#define ASUS_KBBL_GRADIENT_STOPS	8
+/* Sources are degrees C or percent, the bound keeps the interpolation in int */
+#define ASUS_KBBL_GRADIENT_MIN		-1000
+#define ASUS_KBBL_GRADIENT_MAX		1000
+
+struct asus_kbbl_stop {
+	int value;
+	u8 red;
+	u8 green;
+	u8 blue;
+};
+
+struct asus_kbbl_trigger {
+	struct delayed_work work;
+	struct asus_kbbl_stop stop[ASUS_KBBL_GRADIENT_STOPS];
+	int n;
+	u32 period_ms;
+	u32 hysteresis;
+
+	/* Owned by the worker */
+	bool have_value;
+	int value;
+	u32 color;
+	u64 cpu_busy;
+	u64 cpu_total;
+};
+
+/*
+ * The character device of the stream. Open files keep it alive after the
+ * driver went away, asus is NULL then.
+ */
+struct asus_kbbl_stream_dev {
+	struct miscdevice misc;
+	struct kref ref;	/* the driver and each open file */
+	struct mutex lock;	/* asus and opening or closing the stream */
+	struct asus_wmi *asus;
+};
+
+/* Colour frames pushed through a shared page, see asus_kbbl_stream_ring */
+struct asus_kbbl_stream {
+	struct asus_kbbl_stream_dev *dev;
+	struct asus_kbbl_stream_ring *ring;	/* set while open */
+	u32 tail;
+	ktime_t fps_start;
+	u32 fps_frames;
+};
+
+/*
+ * DSTS results are cached per device id. Every known device id has a slot,
+ * see asus_wmi_devids[]. An entry is dropped when the device is written
+ * through DEVS or when the firmware signals a change with a WMI event.
+ * The generation counter keeps a read that raced with an invalidation from
+ * storing a stale value.
+ */
+enum asus_wmi_dev_class {
+	ASUS_WMI_DEV_CLASS_MISC = 0,
+	ASUS_WMI_DEV_CLASS_SENSOR,	/* fan speed, temperature */
+	ASUS_WMI_DEV_CLASS_LIGHT,	/* LEDs and backlight */
+};
+
+struct asus_wmi_devid {
+	u32 dev_id;
+	enum asus_wmi_dev_class class;
+};
+
+static const struct asus_wmi_devid asus_wmi_devids[] = {
+	{ ASUS_WMI_DEVID_HW_SWITCH,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_WIRELESS_LED,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_CWAP,		ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_WLAN,		ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_WLAN_LED,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_BLUETOOTH,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_GPS,		ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_WIMAX,		ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_WWAN3G,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_UWB,		ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_LED1,		ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_LED2,		ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_LED3,		ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_LED4,		ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_LED5,		ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_LED6,		ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_ALS_ENABLE,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_BACKLIGHT,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_BRIGHTNESS,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_KBD_BACKLIGHT,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_LIGHT_SENSOR,	ASUS_WMI_DEV_CLASS_SENSOR },
+	{ ASUS_WMI_DEVID_LIGHTBAR,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_FAN_BOOST_MODE, ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY, ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_KBD_RGB,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_KBD_RGB2,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_CAMERA,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_LID_FLIP,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_CARDREADER,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_TOUCHPAD,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_TOUCHPAD_LED,	ASUS_WMI_DEV_CLASS_LIGHT },
+	{ ASUS_WMI_DEVID_FNLOCK,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_THERMAL_CTRL,	ASUS_WMI_DEV_CLASS_SENSOR },
+	{ ASUS_WMI_DEVID_FAN_CTRL,	ASUS_WMI_DEV_CLASS_SENSOR },
+	{ ASUS_WMI_DEVID_CPU_FAN_CTRL,	ASUS_WMI_DEV_CLASS_SENSOR },
+	{ ASUS_WMI_DEVID_PROCESSOR_STATE, ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_LID_RESUME,	ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_RSOC,		ASUS_WMI_DEV_CLASS_MISC },
+	{ ASUS_WMI_DEVID_KBD_DOCK,	ASUS_WMI_DEV_CLASS_MISC },
+};
+
+#define ASUS_WMI_DEVID_COUNT	ARRAY_SIZE(asus_wmi_devids)
+
+struct asus_wmi_dsts_entry {
+	bool valid;
+	u32 value;
+	unsigned long expires;
+	unsigned int gen;
+};
+
+struct asus_wmi_dsts_cache {
+	spinlock_t lock;
+	u32 hits;
+	u32 misses;
+	struct asus_wmi_dsts_entry entry[ASUS_WMI_DEVID_COUNT];
+};
+
+/*
+ * Last value successfully written with DEVS per device id, indexed like
+ * asus_wmi_devids[]. A write of the same value again is skipped. The mutex
+ * keeps the check, the write and the record of one device together.
+ */
+struct asus_wmi_devs_entry {
+	struct mutex write_lock;
+	unsigned int gen;	/* bumped when the value is forgotten */
+	bool valid;
+	u32 value;
+	u32 retval;
+};
+
+struct asus_wmi_devs_shadow {
+	spinlock_t lock;
+	u32 issued, skipped;
+	struct asus_wmi_devs_entry entry[ASUS_WMI_DEVID_COUNT];
+};
+
+/*
+ * Result of the probe time sweep over asus_wmi_devids[], indexed the same way.
+ * Presence checks consult this instead of calling DSTS again.
+ */
+struct asus_wmi_devcaps {
+	DECLARE_BITMAP(readable, ASUS_WMI_DEVID_COUNT);	/* DSTS succeeded */
+	DECLARE_BITMAP(present, ASUS_WMI_DEVID_COUNT);	/* presence bit set */
+	DECLARE_BITMAP(usable, ASUS_WMI_DEVID_COUNT);	/* ... and status known */
+	u32 value[ASUS_WMI_DEVID_COUNT];
+};
+
+/*
+ * Room for the results of WMI calls. Everything the driver decodes is a
+ * single integer, so this only has to be larger than one acpi_object.
+ */
+#define ASUS_WMI_CALL_BUF_OBJS	8
+
+/* One entry of asus_wmi_evaluate_batch() */
+struct asus_wmi_call {
+	u32 method_id;
+	u32 dev_id;
+	u32 arg;
+	u32 retval;
+	int err;
+};
+
+struct asus_wmi_call_buf {
+	union acpi_object obj[ASUS_WMI_CALL_BUF_OBJS];
+	u32 overflows;
+	bool allocate;		/* set after the first overflow */
+};
+
+/*
+ * WMI calls are issued one at a time. When the interpreter is busy, the
+ * next caller is picked by class: hotkeys and brightness first, other
+ * writes next, polling reads last.
+ */
+enum asus_wmi_prio {
+	ASUS_WMI_PRIO_INTERACTIVE = 0,
+	ASUS_WMI_PRIO_CONTROL,
+	ASUS_WMI_PRIO_BACKGROUND,
+	ASUS_WMI_PRIO_COUNT
+};
+
+struct asus_wmi_sched {
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	bool busy;
+	unsigned int waiting[ASUS_WMI_PRIO_COUNT];
+
+	u32 calls[ASUS_WMI_PRIO_COUNT];
+	u32 waits[ASUS_WMI_PRIO_COUNT];
+	u32 max_wait_us[ASUS_WMI_PRIO_COUNT];
+};
+
+/*
+ * DMA capable buffers handed to the firmware by AGFN calls, allocated once
+ * so fan reads do not depend on ZONE_DMA allocations succeeding later.
+ */
+#define ASUS_AGFN_POOL_BUFS	2
+#define ASUS_AGFN_POOL_BUF_SIZE	sizeof(struct agfn_fan_args)
+
+struct asus_agfn_pool {
+	struct semaphore avail;
+	spinlock_t lock;
+	unsigned long busy;
+	void *buf[ASUS_AGFN_POOL_BUFS];
+	int count;
+};
+
+/*
+ * Embedded controller registers serving the hwmon readings, attached to
+ * atw_dmi_list entries through driver_data. -1 marks an unknown register.
+ */
+struct asus_ec_map {
+	int fan_rpm;
+	int cpu_temp;
+};
+
+/* Set by dmi_check_callback() for the matched model */
+static const struct asus_ec_map *atw_ec_map;
+
+/*
+ * Targets of sysfs stores that can be applied asynchronously. Only the
+ * latest value queued for a target is written.
+ */
+enum asus_async_target {
+	ASUS_ASYNC_KBBL,
+	ASUS_ASYNC_FAN_BOOST_MODE,
+	ASUS_ASYNC_THROTTLE_THERMAL_POLICY,
+	ASUS_ASYNC_PWM1,
+	ASUS_ASYNC_TOUCHPAD,
+	ASUS_ASYNC_CAMERA,
+	ASUS_ASYNC_CARDR,
+	ASUS_ASYNC_LID_RESUME,
+	ASUS_ASYNC_ALS_ENABLE,
+	ASUS_ASYNC_COUNT
+};
+
+struct asus_async_slot {
+	bool pending;
+	int value;
+	u32 queued;	/* sequence number of the latest store */
+	u32 done;	/* sequence number of the latest applied store */
+	int err;
+};
+
+struct asus_async {
+	spinlock_t lock;
+	struct workqueue_struct *workqueue;
+	struct work_struct work;
+	struct asus_async_slot slot[ASUS_ASYNC_COUNT];
+};
+
+/*
+ * Event codes are only read in the notify handler and handled later from
+ * a worker, so the ACPI notify thread never waits for nested WMI calls.
+ * The notify handler and the i8042 filter produce, the worker consumes.
+ */
+#define ASUS_WMI_EVENT_RING_SIZE	64
+
+struct asus_wmi_event_entry {
+	int code;
+	ktime_t notified;	/* WMI notify entry, or the i8042 interrupt */
+	ktime_t fetched;	/* code read back from the firmware */
+	bool injected;		/* from the debugfs inject node */
+};
+
+/* Latency of each stage, measured from notify entry */
+enum asus_wmi_event_stage {
+	ASUS_WMI_STAGE_FETCH = 0,	/* event code fetched */
+	ASUS_WMI_STAGE_QUEUE,		/* picked up by the worker */
+	ASUS_WMI_STAGE_HANDLE,		/* handler and its side effects done */
+	ASUS_WMI_STAGE_REPORT,		/* input event reported */
+	ASUS_WMI_STAGE_COUNT,
+};
+
+/* log2 buckets in us of the notify to handler done latency */
+#define ASUS_WMI_LAT_BUCKETS	16
+
+struct asus_wmi_event_lat {
+	u32 count;
+	u32 reported;
+	u64 sum_us[ASUS_WMI_STAGE_COUNT];
+	u32 max_us[ASUS_WMI_STAGE_COUNT];
+	u32 hist[ASUS_WMI_LAT_BUCKETS];
+};
+
+struct asus_wmi_events {
+	spinlock_t lock;	/* producers: WMI notify and the i8042 filter */
+	DECLARE_KFIFO(ring, struct asus_wmi_event_entry,
+		      ASUS_WMI_EVENT_RING_SIZE);
+	struct workqueue_struct *workqueue;
+	struct work_struct work;
+	u32 max_depth;
+	u32 overflows;
+
+	/* Owned by the worker */
+	const struct asus_wmi_event_entry *cur;
+	ktime_t reported;
+	struct asus_wmi_event_lat *lat;	/* per event code */
+};
+
+/* What asus_wmi_handle_event_code() does with an event code */
+enum asus_wmi_event_action {
+	ASUS_WMI_EVENT_KEY = 0,		/* report through the keymap */
+	ASUS_WMI_EVENT_IGNORE,
+	ASUS_WMI_EVENT_BACKLIGHT,
+	ASUS_WMI_EVENT_KBD_BRTUP,
+	ASUS_WMI_EVENT_KBD_BRTDWN,
+	ASUS_WMI_EVENT_KBD_BRTTOGGLE,
+	ASUS_WMI_EVENT_FNLOCK,
+	ASUS_WMI_EVENT_KBD_DOCK,
+	ASUS_WMI_EVENT_LID_FLIP,
+	ASUS_WMI_EVENT_FAN_BOOST_MODE,
+	ASUS_WMI_EVENT_THROTTLE_THERMAL_POLICY,
+};
+
+/*
+ * Action and keymap entry for every event code, resolved once at probe.
+ * Entries of the keymap stay in place when userspace remaps a key.
+ */
+#define ASUS_WMI_DISPATCH_SIZE	256
+
+struct asus_wmi_dispatch {
+	u8 action[ASUS_WMI_DISPATCH_SIZE];
+	const struct key_entry *key[ASUS_WMI_DISPATCH_SIZE];
+};
+
+/*
+ * Hotkeys that also come as scancodes are taken from the i8042 filter,
+ * the WMI event for the same key is then expected within
+ * ASUS_I8042_DEDUP_MS and dropped.
+ */
+#define ASUS_I8042_DEDUP_MS	250
+
+struct asus_wmi_i8042 {
+	bool extended;		/* last byte was the 0xe0 prefix */
+	u8 expect[ASUS_WMI_DISPATCH_SIZE];
+	unsigned long expect_end[ASUS_WMI_DISPATCH_SIZE];
+	u32 handled;
+	u32 deduped;
+};
+
+/* Synthetic events fed through the event ring from debugfs */
+#define ASUS_WMI_INJECT_MAX	32
+
+struct asus_wmi_inject {
+	struct work_struct work;
+	struct mutex lock;	/* claims running for one writer */
+	int codes[ASUS_WMI_INJECT_MAX];
+	int n;
+	u32 rate;
+	u32 count;
+	bool running;
+	bool stop;
+
+	/* Last run, handled and the latencies are updated by the worker */
+	u32 sent;
+	u32 dropped;
+	u32 handled;
+	u64 lat_sum_us;
+	u32 lat_max_us;
+	ktime_t start;
+	ktime_t end;
+};
+
+/*
+ * Hotkey driven writes of one level. The first key press is written at
+ * once, repeats arriving within hotkey_coalesce_ms only update the target
+ * and the last one is written when the window closes.
+ */
+struct asus_wmi_coalesce {
+	spinlock_t lock;
+	struct delayed_work work;
+	unsigned long window_end;
+	unsigned int seq;
+	bool pending;
+};
+
+enum asus_wmi_led_id {
+	ASUS_WMI_LED_TPD,
+	ASUS_WMI_LED_KBD,
+	ASUS_WMI_LED_WLAN,
+	ASUS_WMI_LED_LIGHTBAR,
+	ASUS_WMI_LED_RGB,
+	ASUS_WMI_LED_COUNT,
+};
+
+/* Per LED state of the shared LED worker */
+struct asus_wmi_led_slot {
+	struct led_classdev *cdev;
+	int *want;		/* latest requested value */
+	bool dirty;		/* want was requested but not written yet */
+	int applied;		/* last value written, -1 if unknown */
+	unsigned long last;	/* jiffies of the last write */
+	unsigned int min_interval_ms;
+	/* For LEDs that are not written through asus_wmi_led_write() */
+	void (*write)(struct asus_wmi *asus, int value);
+};
+
 enum fan_type {
 	FAN_TYPE_NONE = 0,
 	FAN_TYPE_AGFN,		/* deprecated on newer platforms */
@@ -226,6 +886,7 @@ struct asus_wmi {
 
 	struct input_dev *inputdev;
 	struct backlight_device *backlight_device;
+	struct asus_wmi_coalesce backlight_coalesce;
 	struct platform_device *platform_device;
 
 	struct led_classdev wlan_led;
@@ -234,12 +895,13 @@ struct asus_wmi {
 	int tpd_led_wk;
 	struct led_classdev kbd_led;
 	int kbd_led_wk;
+	struct asus_wmi_coalesce kbd_led_coalesce;
 	struct led_classdev lightbar_led;
 	int lightbar_led_wk;
 	struct workqueue_struct *led_workqueue;
-	struct work_struct tpd_led_work;
-	struct work_struct wlan_led_work;
-	struct work_struct lightbar_led_work;
+	struct delayed_work led_work;
+	struct mutex led_lock;
+	struct asus_wmi_led_slot led_slots[ASUS_WMI_LED_COUNT];
 
 	struct asus_rfkill wlan;
 	struct asus_rfkill bluetooth;
@@ -252,6 +914,11 @@ struct asus_wmi {
 	int fan_pwm_mode;
 	int agfn_pwm;
 
+	/* EC registers that passed the self-check, -1 to go through WMI */
+	int ec_fan_rpm_reg;
+	bool ec_fan_rpm_checked;
+	int ec_cpu_temp_reg;
+
 	bool fan_boost_mode_available;
 	u8 fan_boost_mode_mask;
 	u8 fan_boost_mode;
@@ -261,9 +928,20 @@ struct asus_wmi {
 
 	// The RSOC controls the maximum charging percentage.
 	bool battery_rsoc_available;
+	char battery_name[16];
 
 	bool kbbl_rgb_available;
+#ifdef ASUS_KBBL_LED_MC
+	struct led_classdev_mc kbbl_mc;
+	struct mc_subled kbbl_subled[3];
+	int kbbl_mc_wk;		/* 0xRRGGBB */
+	bool kbbl_mc_registered;
+#endif
 	struct asus_kbbl_rgb kbbl_rgb;
+	struct asus_kbbl_anim kbbl_anim;
+	struct asus_kbbl_stream kbbl_stream;
+	struct asus_kbbl_trigger kbbl_trigger;
+	struct asus_wmi_idle idle;
 
 	struct hotplug_slot hotplug_slot;
 	struct mutex hotplug_lock;
@@ -273,14 +951,146 @@ struct asus_wmi {
 
 	bool fnlock_locked;
 
+	struct asus_wmi_dsts_cache dsts_cache;
+	struct asus_wmi_devs_shadow devs_shadow;
+	struct asus_wmi_devcaps caps;
+	struct asus_wmi_call_buf call_buf;
+	struct asus_wmi_sched sched;
+	struct asus_async async;
+	struct asus_wmi_events events;
+	struct asus_wmi_dispatch dispatch;
+	struct asus_wmi_i8042 i8042;
+	struct asus_wmi_inject inject;
+	struct task_struct *event_task;
+	struct asus_agfn_pool agfn_pool;
+
 	struct asus_wmi_debug debug;
 
 	struct asus_wmi_driver *driver;
 };
 
+/* For callbacks that have no way to reach the instance, e.g. battery hooks */
+static struct asus_wmi *asus_ref;
+
+/* Bound by atw_wmi_driver before the platform device is created */
+static struct wmi_device *atw_wmi_mgmt_dev;
+
 /* WMI ************************************************************************/
 
-static int asus_wmi_evaluate_method3(u32 method_id,
+static enum asus_wmi_prio asus_wmi_call_prio(struct asus_wmi *asus,
+					     u32 method_id, u32 dev_id)
+{
+	/* Anything done on behalf of a hotkey */
+	if (asus->event_task == current)
+		return ASUS_WMI_PRIO_INTERACTIVE;
+
+	if (method_id == ASUS_WMI_METHODID_DEVS) {
+		switch (dev_id) {
+		case ASUS_WMI_DEVID_KBD_BACKLIGHT:
+		case ASUS_WMI_DEVID_BRIGHTNESS:
+		case ASUS_WMI_DEVID_BACKLIGHT:
+		case ASUS_WMI_DEVID_KBD_RGB:
+		case ASUS_WMI_DEVID_KBD_RGB2:
+			return ASUS_WMI_PRIO_INTERACTIVE;
+		default:
+			return ASUS_WMI_PRIO_CONTROL;
+		}
+	}
+
+	if (method_id == asus->dsts_id || method_id == ASUS_WMI_METHODID_AGFN)
+		return ASUS_WMI_PRIO_BACKGROUND;
+
+	return ASUS_WMI_PRIO_CONTROL;
+}
+
+static bool asus_wmi_sched_try_begin(struct asus_wmi_sched *sched,
+				     enum asus_wmi_prio prio)
+{
+	bool ok;
+	int i;
+
+	spin_lock(&sched->lock);
+	ok = !sched->busy;
+	for (i = 0; ok && i < prio; i++)
+		ok = !sched->waiting[i];
+
+	if (ok) {
+		sched->busy = true;
+		sched->waiting[prio]--;
+	}
+	spin_unlock(&sched->lock);
+
+	return ok;
+}
+
+/* Take the call buffer, possibly after higher priority callers */
+static void asus_wmi_call_begin(struct asus_wmi *asus, enum asus_wmi_prio prio)
+{
+	struct asus_wmi_sched *sched = &asus->sched;
+	ktime_t start;
+	u32 wait_us;
+
+	spin_lock(&sched->lock);
+	sched->waiting[prio]++;
+	sched->calls[prio]++;
+	spin_unlock(&sched->lock);
+
+	if (asus_wmi_sched_try_begin(sched, prio))
+		return;
+
+	start = ktime_get();
+	wait_event(sched->wq, asus_wmi_sched_try_begin(sched, prio));
+	wait_us = ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&sched->lock);
+	sched->waits[prio]++;
+	if (wait_us > sched->max_wait_us[prio])
+		sched->max_wait_us[prio] = wait_us;
+	spin_unlock(&sched->lock);
+}
+
+static void asus_wmi_call_end(struct asus_wmi *asus)
+{
+	struct asus_wmi_sched *sched = &asus->sched;
+
+	spin_lock(&sched->lock);
+	sched->busy = false;
+	spin_unlock(&sched->lock);
+
+	wake_up_all(&sched->wq);
+}
+
+/* Stores the integer result in *value, returns -EIO if there is none */
+static int asus_wmi_call_buf_decode(struct asus_wmi *asus,
+				    struct acpi_buffer *output,
+				    acpi_status status, u64 *value)
+{
+	union acpi_object *obj = output->pointer;
+
+	if (status == AE_BUFFER_OVERFLOW) {
+		asus->call_buf.overflows++;
+		asus->call_buf.allocate = true;
+		return -EIO;
+	}
+
+	if (ACPI_FAILURE(status) || !output->length ||
+	    obj->type != ACPI_TYPE_INTEGER)
+		return -EIO;
+
+	*value = obj->integer.value;
+	return 0;
+}
+
+/*
+ * Results are returned into the per-instance call buffer instead of having
+ * ACPI allocate one for every call. The method has already run by the time
+ * ACPI reports that the result did not fit. DSTS reads are then run again
+ * with a buffer from ACPI, DEVS or _WED must not be executed twice. After
+ * the first oversized result, ACPI allocates the buffer for every call.
+ *
+ * Must be called between asus_wmi_call_begin() and asus_wmi_call_end().
+ */
+static int __asus_wmi_evaluate_method3(struct asus_wmi *asus, u32 method_id,
 		u32 arg0, u32 arg1, u32 arg2, u32 *retval)
 {
 	struct bios_args args = {
@@ -289,89 +1099,513 @@ static int asus_wmi_evaluate_method3(u32 method_id,
 		.arg2 = arg2,
 	};
 	struct acpi_buffer input = { (acpi_size) sizeof(args), &args };
-	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	struct acpi_buffer output = {
+		sizeof(asus->call_buf.obj), asus->call_buf.obj
+	};
 	acpi_status status;
-	union acpi_object *obj;
+	u64 value;
 	u32 tmp = 0;
+	int err;
 
-	status = wmi_evaluate_method(ASUS_WMI_MGMT_GUID, 0, method_id,
-				     &input, &output);
+	if (!atw_wmi_mgmt_dev)
+		return -ENODEV;
 
-	if (ACPI_FAILURE(status))
-		return -EIO;
+	if (asus->call_buf.allocate)
+		output = (struct acpi_buffer) { ACPI_ALLOCATE_BUFFER, NULL };
 
-	obj = (union acpi_object *)output.pointer;
-	if (obj && obj->type == ACPI_TYPE_INTEGER)
-		tmp = (u32) obj->integer.value;
+	status = wmidev_evaluate_method(atw_wmi_mgmt_dev, 0, method_id,
+					&input, &output);
+
+	if (status == AE_BUFFER_OVERFLOW && method_id == asus->dsts_id) {
+		asus->call_buf.overflows++;
+		asus->call_buf.allocate = true;
+		output = (struct acpi_buffer) { ACPI_ALLOCATE_BUFFER, NULL };
+		status = wmidev_evaluate_method(atw_wmi_mgmt_dev, 0, method_id,
+						&input, &output);
+	}
+
+	if (ACPI_FAILURE(status) && status != AE_BUFFER_OVERFLOW) {
+		err = -EIO;
+		goto out;
+	}
+
+	if (!asus_wmi_call_buf_decode(asus, &output, status, &value))
+		tmp = (u32) value;
 
 	if (retval)
 		*retval = tmp;
 
-	kfree(obj);
+	err = tmp == ASUS_WMI_UNSUPPORTED_METHOD ? -ENODEV : 0;
 
-	if (tmp == ASUS_WMI_UNSUPPORTED_METHOD)
-		return -ENODEV;
+out:
+	if (output.pointer != asus->call_buf.obj)
+		kfree(output.pointer);
 
-	return 0;
+	return err;
 }
 
-static int asus_wmi_evaluate_method(u32 method_id, u32 arg0, u32 arg1, u32 *retval)
+static int asus_wmi_evaluate_method3(struct asus_wmi *asus, u32 method_id,
+		u32 arg0, u32 arg1, u32 arg2, u32 *retval)
 {
-	return asus_wmi_evaluate_method3(method_id, arg0, arg1, 0, retval);
-}
+	int err;
 
-static int asus_wmi_evaluate_method_agfn(const struct acpi_buffer args)
-{
-	struct acpi_buffer input;
-	u64 phys_addr;
-	u32 retval;
-	u32 status;
+	asus_wmi_call_begin(asus, asus_wmi_call_prio(asus, method_id, arg0));
+	err = __asus_wmi_evaluate_method3(asus, method_id, arg0, arg1, arg2,
+					  retval);
+	asus_wmi_call_end(asus);
 
-	/*
-	 * Copy to dma capable address otherwise memory corruption occurs as
-	 * bios has to be able to access it.
-	 */
-	input.pointer = kmemdup(args.pointer, args.length, GFP_DMA | GFP_KERNEL);
-	input.length = args.length;
-	if (!input.pointer)
-		return -ENOMEM;
-	phys_addr = virt_to_phys(input.pointer);
+	return err;
+}
 
-	status = asus_wmi_evaluate_method(ASUS_WMI_METHODID_AGFN,
-					phys_addr, 0, &retval);
-	if (!status)
-		memcpy(args.pointer, input.pointer, args.length);
+/*
+ * Run several calls back to back under a single hold of the call buffer.
+ * Each call gets its own result and error, the batch itself cannot fail.
+ */
+static void asus_wmi_evaluate_batch(struct asus_wmi *asus,
+				    struct asus_wmi_call *calls, int n)
+{
+	enum asus_wmi_prio prio = ASUS_WMI_PRIO_BACKGROUND;
+	int i;
 
-	kfree(input.pointer);
-	if (status)
-		return -ENXIO;
+	/* The whole batch runs at the class of its most urgent call */
+	for (i = 0; i < n; i++)
+		prio = min(prio, asus_wmi_call_prio(asus, calls[i].method_id,
+						    calls[i].dev_id));
 
-	return retval;
+	asus_wmi_call_begin(asus, prio);
+	for (i = 0; i < n; i++)
+		calls[i].err = __asus_wmi_evaluate_method3(asus,
+							   calls[i].method_id,
+							   calls[i].dev_id,
+							   calls[i].arg, 0,
+							   &calls[i].retval);
+	asus_wmi_call_end(asus);
 }
 
-static int asus_wmi_get_devstate(struct asus_wmi *asus, u32 dev_id, u32 *retval)
+static int asus_wmi_evaluate_method(struct asus_wmi *asus, u32 method_id,
+				    u32 arg0, u32 arg1, u32 *retval)
 {
-	return asus_wmi_evaluate_method(asus->dsts_id, dev_id, 0, retval);
+	return asus_wmi_evaluate_method3(asus, method_id, arg0, arg1, 0,
+					 retval);
 }
 
-static int asus_wmi_set_devstate(u32 dev_id, u32 ctrl_param,
-				 u32 *retval)
+static void asus_agfn_pool_init(struct asus_wmi *asus)
 {
-	return asus_wmi_evaluate_method(ASUS_WMI_METHODID_DEVS, dev_id,
-					ctrl_param, retval);
-}
+	struct asus_agfn_pool *pool = &asus->agfn_pool;
+	int i;
 
-/* Helper for special devices with magic return codes */
-static int asus_wmi_get_devstate_bits(struct asus_wmi *asus,
-				      u32 dev_id, u32 mask)
+	spin_lock_init(&pool->lock);
+
+	for (i = 0; i < ASUS_AGFN_POOL_BUFS; i++) {
+		pool->buf[i] = kzalloc(ASUS_AGFN_POOL_BUF_SIZE,
+				       GFP_DMA | GFP_KERNEL);
+		if (!pool->buf[i])
+			break;
+	}
+	pool->count = i;
+	pool->busy = 0;
+
+	sema_init(&pool->avail, pool->count);
+}
+
+static void asus_agfn_pool_exit(struct asus_wmi *asus)
 {
-	u32 retval = 0;
+	struct asus_agfn_pool *pool = &asus->agfn_pool;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		kfree(pool->buf[i]);
+		pool->buf[i] = NULL;
+	}
+	pool->count = 0;
+}
+
+/* Returns a pool buffer index, or -1 if the caller has to allocate */
+static int asus_agfn_pool_get(struct asus_wmi *asus, size_t len)
+{
+	struct asus_agfn_pool *pool = &asus->agfn_pool;
+	int i;
+
+	if (!pool->count || len > ASUS_AGFN_POOL_BUF_SIZE)
+		return -1;
+
+	down(&pool->avail);
+
+	spin_lock(&pool->lock);
+	i = find_first_zero_bit(&pool->busy, pool->count);
+	__set_bit(i, &pool->busy);
+	spin_unlock(&pool->lock);
+
+	return i;
+}
+
+static void asus_agfn_pool_put(struct asus_wmi *asus, int i)
+{
+	struct asus_agfn_pool *pool = &asus->agfn_pool;
+
+	spin_lock(&pool->lock);
+	__clear_bit(i, &pool->busy);
+	spin_unlock(&pool->lock);
+
+	up(&pool->avail);
+}
+
+static int asus_wmi_evaluate_method_agfn(struct asus_wmi *asus,
+					 const struct acpi_buffer args)
+{
+	struct acpi_buffer input;
+	u64 phys_addr;
+	u32 retval;
+	u32 status;
+	int slot;
+
+	/*
+	 * Copy to dma capable address otherwise memory corruption occurs as
+	 * bios has to be able to access it.
+	 */
+	slot = asus_agfn_pool_get(asus, args.length);
+	if (slot >= 0) {
+		input.pointer = asus->agfn_pool.buf[slot];
+		memcpy(input.pointer, args.pointer, args.length);
+	} else {
+		input.pointer = kmemdup(args.pointer, args.length,
+					GFP_DMA | GFP_KERNEL);
+		if (!input.pointer)
+			return -ENOMEM;
+	}
+	input.length = args.length;
+	phys_addr = virt_to_phys(input.pointer);
+
+	status = asus_wmi_evaluate_method(asus, ASUS_WMI_METHODID_AGFN,
+					  phys_addr, 0, &retval);
+	if (!status)
+		memcpy(args.pointer, input.pointer, args.length);
+
+	if (slot >= 0)
+		asus_agfn_pool_put(asus, slot);
+	else
+		kfree(input.pointer);
+	if (status)
+		return -ENXIO;
+
+	return retval;
+}
+
+static int asus_wmi_devid_index(u32 dev_id)
+{
+	int i;
+
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+		if (asus_wmi_devids[i].dev_id == dev_id)
+			return i;
+	}
+
+	return -1;
+}
+
+static unsigned int asus_wmi_dsts_ttl(int idx)
+{
+	switch (asus_wmi_devids[idx].class) {
+	case ASUS_WMI_DEV_CLASS_SENSOR:
+		return dsts_ttl_sensor;
+	case ASUS_WMI_DEV_CLASS_LIGHT:
+		return dsts_ttl_light;
+	default:
+		return dsts_ttl_misc;
+	}
+}
+
+static void asus_wmi_dsts_invalidate(struct asus_wmi *asus, u32 dev_id)
+{
+	struct asus_wmi_dsts_cache *cache = &asus->dsts_cache;
+	int idx = asus_wmi_devid_index(dev_id);
+
+	if (idx < 0)
+		return;
+
+	spin_lock(&cache->lock);
+	cache->entry[idx].valid = false;
+	cache->entry[idx].gen++;
+	spin_unlock(&cache->lock);
+}
+
+static void asus_wmi_dsts_invalidate_all(struct asus_wmi *asus)
+{
+	struct asus_wmi_dsts_cache *cache = &asus->dsts_cache;
+	int i;
+
+	spin_lock(&cache->lock);
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+		cache->entry[i].valid = false;
+		cache->entry[i].gen++;
+	}
+	spin_unlock(&cache->lock);
+}
+
+static void asus_wmi_devs_shadow_drop(struct asus_wmi *asus, u32 dev_id)
+{
+	struct asus_wmi_devs_shadow *shadow = &asus->devs_shadow;
+	int idx = asus_wmi_devid_index(dev_id);
+
+	if (idx < 0)
+		return;
+
+	spin_lock(&shadow->lock);
+	shadow->entry[idx].valid = false;
+	shadow->entry[idx].gen++;
+	spin_unlock(&shadow->lock);
+}
+
+/*
+ * The firmware changed the state of a device on its own: neither the cached
+ * DSTS value nor the last DEVS value can be trusted anymore.
+ */
+static void asus_wmi_forget_state(struct asus_wmi *asus, u32 dev_id)
+{
+	asus_wmi_dsts_invalidate(asus, dev_id);
+	asus_wmi_devs_shadow_drop(asus, dev_id);
+}
+
+/* Same for all devices, e.g. after the firmware state was lost on resume */
+static void asus_wmi_forget_all_state(struct asus_wmi *asus)
+{
+	struct asus_wmi_devs_shadow *shadow = &asus->devs_shadow;
+	int i;
+
+	asus_wmi_dsts_invalidate_all(asus);
+
+	spin_lock(&shadow->lock);
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+		shadow->entry[i].valid = false;
+		shadow->entry[i].gen++;
+	}
+	spin_unlock(&shadow->lock);
+}
+
+/* Cache a value read from the firmware, unless invalidated in the meantime */
+static void asus_wmi_dsts_fill(struct asus_wmi *asus, int idx,
+			       unsigned int gen, u32 value)
+{
+	struct asus_wmi_dsts_cache *cache = &asus->dsts_cache;
+	struct asus_wmi_dsts_entry *entry = &cache->entry[idx];
+
+	spin_lock(&cache->lock);
+	if (entry->gen == gen) {
+		entry->value = value;
+		entry->expires = jiffies +
+				 msecs_to_jiffies(asus_wmi_dsts_ttl(idx));
+		entry->valid = true;
+	}
+	spin_unlock(&cache->lock);
+}
+
+static int asus_wmi_get_devstate(struct asus_wmi *asus, u32 dev_id, u32 *retval)
+{
+	struct asus_wmi_dsts_cache *cache = &asus->dsts_cache;
+	struct asus_wmi_dsts_entry *entry;
+	unsigned int ttl = 0;
+	unsigned int gen;
+	u32 value;
+	int idx;
 	int err;
 
-	err = asus_wmi_get_devstate(asus, dev_id, &retval);
-	if (err < 0)
+	idx = asus_wmi_devid_index(dev_id);
+	if (idx >= 0)
+		ttl = asus_wmi_dsts_ttl(idx);
+
+	if (!ttl)
+		return asus_wmi_evaluate_method(asus, asus->dsts_id, dev_id, 0,
+						retval);
+
+	entry = &cache->entry[idx];
+
+	spin_lock(&cache->lock);
+	if (entry->valid && time_before(jiffies, entry->expires)) {
+		value = entry->value;
+		cache->hits++;
+		spin_unlock(&cache->lock);
+
+		if (retval)
+			*retval = value;
+		return 0;
+	}
+	cache->misses++;
+	gen = entry->gen;
+	spin_unlock(&cache->lock);
+
+	err = asus_wmi_evaluate_method(asus, asus->dsts_id, dev_id, 0, &value);
+	if (err == -EIO)
+		return err;
+
+	if (retval)
+		*retval = value;
+
+	if (err)
 		return err;
 
+	asus_wmi_dsts_fill(asus, idx, gen, value);
+
+	return 0;
+}
+
+/*
+ * Read the state of every dev_id in calls[] in one batch. The reads always
+ * go to the firmware and refresh the DSTS cache on the way back.
+ */
+static void asus_wmi_get_devstate_batch(struct asus_wmi *asus,
+					struct asus_wmi_call *calls, int n)
+{
+	struct asus_wmi_dsts_cache *cache = &asus->dsts_cache;
+	unsigned int gen[ASUS_WMI_DEVID_COUNT];
+	int i, idx;
+
+	spin_lock(&cache->lock);
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++)
+		gen[i] = cache->entry[i].gen;
+	spin_unlock(&cache->lock);
+
+	for (i = 0; i < n; i++) {
+		calls[i].method_id = asus->dsts_id;
+		calls[i].arg = 0;
+	}
+
+	asus_wmi_evaluate_batch(asus, calls, n);
+
+	for (i = 0; i < n; i++) {
+		idx = asus_wmi_devid_index(calls[i].dev_id);
+		if (calls[i].err || idx < 0 || !asus_wmi_dsts_ttl(idx))
+			continue;
+
+		asus_wmi_dsts_fill(asus, idx, gen[idx], calls[i].retval);
+	}
+}
+
+static void asus_wmi_devs_shadow_init(struct asus_wmi *asus)
+{
+	struct asus_wmi_devs_shadow *shadow = &asus->devs_shadow;
+	int i;
+
+	spin_lock_init(&shadow->lock);
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++)
+		mutex_init(&shadow->entry[i].write_lock);
+}
+
+/*
+ * Skip the write if the device was last set to the same value, unless
+ * forced. Sensors and fan control are not shadowed, writing them is a
+ * command, not a state. Must be called with the entry's write_lock held.
+ */
+static bool asus_wmi_devs_shadow_hit(struct asus_wmi *asus, int idx,
+				     u32 ctrl_param, u32 *retval,
+				     unsigned int *gen, bool force)
+{
+	struct asus_wmi_devs_shadow *shadow = &asus->devs_shadow;
+	struct asus_wmi_devs_entry *entry = &shadow->entry[idx];
+	bool hit;
+
+	spin_lock(&shadow->lock);
+	*gen = entry->gen;
+	hit = !force && entry->valid && entry->value == ctrl_param;
+	if (hit) {
+		shadow->skipped++;
+		if (retval)
+			*retval = entry->retval;
+	}
+	spin_unlock(&shadow->lock);
+
+	return hit;
+}
+
+/*
+ * Record a write that went to the firmware, idx is -1 if not shadowed.
+ * Unless the state was forgotten during the write, see gen.
+ */
+static void asus_wmi_devs_shadow_store(struct asus_wmi *asus, int idx,
+				       unsigned int gen, u32 ctrl_param,
+				       u32 retval, int err)
+{
+	struct asus_wmi_devs_shadow *shadow = &asus->devs_shadow;
+	struct asus_wmi_devs_entry *entry;
+
+	spin_lock(&shadow->lock);
+	shadow->issued++;
+	if (idx >= 0 && shadow->entry[idx].gen == gen) {
+		entry = &shadow->entry[idx];
+		/*
+		 * Failed writes are retried. The ack is device specific,
+		 * mostly 1, but 0 always means the value was rejected.
+		 */
+		entry->valid = !err && retval != 0;
+		entry->value = ctrl_param;
+		entry->retval = retval;
+	}
+	spin_unlock(&shadow->lock);
+}
+
+static int __asus_wmi_set_devstate(struct asus_wmi *asus, u32 dev_id,
+				   u32 ctrl_param, u32 *retval, bool force)
+{
+	int idx = asus_wmi_devid_index(dev_id);
+	struct mutex *write_lock = NULL;
+	unsigned int gen = 0;
+	u32 result = 0;
+	int err;
+
+	if (idx >= 0 && asus_wmi_devids[idx].class == ASUS_WMI_DEV_CLASS_SENSOR)
+		idx = -1;
+
+	if (idx >= 0) {
+		write_lock = &asus->devs_shadow.entry[idx].write_lock;
+		mutex_lock(write_lock);
+
+		if (asus_wmi_devs_shadow_hit(asus, idx, ctrl_param, retval,
+					     &gen, force)) {
+			mutex_unlock(write_lock);
+			return 0;
+		}
+	}
+
+	err = asus_wmi_evaluate_method(asus, ASUS_WMI_METHODID_DEVS, dev_id,
+				       ctrl_param, &result);
+	if (retval && err != -EIO)
+		*retval = result;
+
+	asus_wmi_devs_shadow_store(asus, idx, gen, ctrl_param, result, err);
+	if (write_lock)
+		mutex_unlock(write_lock);
+
+	asus_wmi_dsts_invalidate(asus, dev_id);
+
+	/*
+	 * Some states are reported through a different device id than the
+	 * one they are set with, see asus_rfkill_set() and update_bl_status().
+	 */
+	if (dev_id == ASUS_WMI_DEVID_WLAN_LED)
+		asus_wmi_dsts_invalidate(asus, ASUS_WMI_DEVID_WLAN);
+	else if (dev_id == ASUS_WMI_DEVID_BACKLIGHT)
+		asus_wmi_dsts_invalidate(asus, ASUS_WMI_DEVID_BRIGHTNESS);
+	else if (dev_id == ASUS_WMI_DEVID_BRIGHTNESS)
+		asus_wmi_dsts_invalidate(asus, ASUS_WMI_DEVID_BACKLIGHT);
+
+	return err;
+}
+
+static int asus_wmi_set_devstate(struct asus_wmi *asus, u32 dev_id,
+				 u32 ctrl_param, u32 *retval)
+{
+	return __asus_wmi_set_devstate(asus, dev_id, ctrl_param, retval, false);
+}
+
+/* Write even if the shadow says the device already has this value */
+static int asus_wmi_set_devstate_force(struct asus_wmi *asus, u32 dev_id,
+				       u32 ctrl_param, u32 *retval)
+{
+	return __asus_wmi_set_devstate(asus, dev_id, ctrl_param, retval, true);
+}
+
+/* Helper for special devices with magic return codes */
+static int asus_wmi_devstate_bits(u32 retval, u32 mask)
+{
 	if (!(retval & ASUS_WMI_DSTS_PRESENCE_BIT))
 		return -ENODEV;
 
@@ -383,18 +1617,132 @@ static int asus_wmi_get_devstate_bits(struct asus_wmi *asus,
 	return retval & mask;
 }
 
+static int asus_wmi_get_devstate_bits(struct asus_wmi *asus,
+				      u32 dev_id, u32 mask)
+{
+	u32 retval = 0;
+	int err;
+
+	err = asus_wmi_get_devstate(asus, dev_id, &retval);
+	if (err < 0)
+		return err;
+
+	return asus_wmi_devstate_bits(retval, mask);
+}
+
 static int asus_wmi_get_devstate_simple(struct asus_wmi *asus, u32 dev_id)
 {
 	return asus_wmi_get_devstate_bits(asus, dev_id,
 					  ASUS_WMI_DSTS_STATUS_BIT);
 }
 
+/*
+ * Read every known device id once. The results are kept in asus->caps and,
+ * as a side effect, warm up the DSTS cache for the rest of the probe.
+ */
+static int asus_wmi_probe_devices(struct asus_wmi *asus)
+{
+	struct asus_wmi_devcaps *caps = &asus->caps;
+	struct asus_wmi_call *calls;
+	u32 value;
+	int i;
+
+	calls = kcalloc(ASUS_WMI_DEVID_COUNT, sizeof(*calls), GFP_KERNEL);
+	if (!calls)
+		return -ENOMEM;
+
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++)
+		calls[i].dev_id = asus_wmi_devids[i].dev_id;
+
+	asus_wmi_get_devstate_batch(asus, calls, ASUS_WMI_DEVID_COUNT);
+
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+		if (calls[i].err)
+			continue;
+
+		value = calls[i].retval;
+
+		__set_bit(i, caps->readable);
+		caps->value[i] = value;
+
+		if (!(value & ASUS_WMI_DSTS_PRESENCE_BIT))
+			continue;
+
+		__set_bit(i, caps->present);
+		if (!(value & ASUS_WMI_DSTS_UNKNOWN_BIT))
+			__set_bit(i, caps->usable);
+	}
+
+	kfree(calls);
+	return 0;
+}
+
+static bool asus_wmi_dev_is_readable(struct asus_wmi *asus, u32 dev_id)
+{
+	int idx = asus_wmi_devid_index(dev_id);
+
+	return idx >= 0 && test_bit(idx, asus->caps.readable);
+}
+
 static bool asus_wmi_dev_is_present(struct asus_wmi *asus, u32 dev_id)
 {
-	u32 retval;
-	int status = asus_wmi_get_devstate(asus, dev_id, &retval);
+	int idx = asus_wmi_devid_index(dev_id);
+
+	return idx >= 0 && test_bit(idx, asus->caps.present);
+}
+
+/* Same as asus_wmi_get_devstate_simple() not failing, as of probe time */
+static bool asus_wmi_dev_is_usable(struct asus_wmi *asus, u32 dev_id)
+{
+	int idx = asus_wmi_devid_index(dev_id);
+
+	return idx >= 0 && test_bit(idx, asus->caps.usable);
+}
+
+/* DSTS value read at probe time, 0 if the read failed */
+static u32 asus_wmi_dev_probe_value(struct asus_wmi *asus, u32 dev_id)
+{
+	int idx = asus_wmi_devid_index(dev_id);
 
-	return status == 0 && (retval & ASUS_WMI_DSTS_PRESENCE_BIT);
+	return idx >= 0 ? asus->caps.value[idx] : 0;
+}
+
+/* Asynchronous writes ********************************************************/
+
+/* DEVS device behind plain store_sys_wmi() targets */
+static const u32 asus_async_devid[ASUS_ASYNC_COUNT] = {
+	[ASUS_ASYNC_TOUCHPAD] = ASUS_WMI_DEVID_TOUCHPAD,
+	[ASUS_ASYNC_CAMERA] = ASUS_WMI_DEVID_CAMERA,
+	[ASUS_ASYNC_CARDR] = ASUS_WMI_DEVID_CARDREADER,
+	[ASUS_ASYNC_LID_RESUME] = ASUS_WMI_DEVID_LID_RESUME,
+	[ASUS_ASYNC_ALS_ENABLE] = ASUS_WMI_DEVID_ALS_ENABLE,
+};
+
+static int asus_async_target_of(u32 dev_id)
+{
+	int i;
+
+	for (i = 0; i < ASUS_ASYNC_COUNT; i++) {
+		if (asus_async_devid[i] && asus_async_devid[i] == dev_id)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Replaces whatever was still pending for the target */
+static void asus_async_queue(struct asus_wmi *asus,
+			     enum asus_async_target target, int value)
+{
+	struct asus_async_slot *slot = &asus->async.slot[target];
+
+	spin_lock(&asus->async.lock);
+	slot->pending = true;
+	slot->value = value;
+	slot->queued++;
+	spin_unlock(&asus->async.lock);
+
+	queue_work(asus->async.workqueue, &asus->async.work);
 }
 
 /* Input **********************************************************************/
@@ -462,13 +1810,29 @@ static void asus_wmi_input_exit(struct asus_wmi *asus)
 
 /* Tablet mode ****************************************************************/
 
+/* Input events carry the time the firmware notified us */
+static void asus_wmi_event_report_begin(struct asus_wmi *asus)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,4,0)
+	if (asus->events.cur)
+		input_set_timestamp(asus->inputdev, asus->events.cur->notified);
+#endif
+}
+
+static void asus_wmi_event_report_end(struct asus_wmi *asus)
+{
+	asus->events.reported = ktime_get();
+}
+
 static void lid_flip_tablet_mode_get_state(struct asus_wmi *asus)
 {
 	int result = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_LID_FLIP);
 
 	if (result >= 0) {
+		asus_wmi_event_report_begin(asus);
 		input_report_switch(asus->inputdev, SW_TABLET_MODE, result);
 		input_sync(asus->inputdev);
+		asus_wmi_event_report_end(asus);
 	}
 }
 
@@ -490,7 +1854,7 @@ static ssize_t charge_control_end_threshold_store(struct device *dev,
 	if (value < 0 || value > 100)
 		return -EINVAL;
 
-	ret = asus_wmi_set_devstate(ASUS_WMI_DEVID_RSOC, value, &rv);
+	ret = asus_wmi_set_devstate(asus_ref, ASUS_WMI_DEVID_RSOC, value, &rv);
 	if (ret)
 		return ret;
 
@@ -534,14 +1898,19 @@ static int asus_wmi_battery_add(struct power_supply *battery)
 	 * and we can't get the current threshold so let set it to 100% when
 	 * a battery is added.
 	 */
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_RSOC, 100, NULL);
+	asus_wmi_set_devstate(asus_ref, ASUS_WMI_DEVID_RSOC, 100, NULL);
 	charge_end_threshold = 100;
 
+	strscpy(asus_ref->battery_name, battery->desc->name,
+		sizeof(asus_ref->battery_name));
+
 	return 0;
 }
 
 static int asus_wmi_battery_remove(struct power_supply *battery)
 {
+	asus_ref->battery_name[0] = '\0';
+
 	device_remove_file(&battery->dev,
 			   &dev_attr_charge_control_end_threshold);
 	return 0;
@@ -571,31 +1940,209 @@ static void asus_wmi_battery_exit(struct asus_wmi *asus)
 /* LEDs ***********************************************************************/
 
 /*
- * These functions actually update the LED's, and are called from a
- * workqueue. By doing this as separate work rather than when the LED
- * subsystem asks, we avoid messing with the Asus ACPI stuff during a
- * potentially bad time, such as a timer interrupt.
+ * The LED subsystem only records the requested value, the LEDs are actually
+ * updated from one worker. By doing this as separate work rather than when
+ * the LED subsystem asks, we avoid messing with the Asus ACPI stuff during a
+ * potentially bad time, such as a timer interrupt. The worker skips values
+ * that are already set and keeps the writes to one LED at least
+ * min_interval_ms apart, so blinking triggers collapse to the latest value.
  */
-static void tpd_led_update(struct work_struct *work)
-{
-	int ctrl_param;
-	struct asus_wmi *asus;
-
-	asus = container_of(work, struct asus_wmi, tpd_led_work);
-
-	ctrl_param = asus->tpd_led_wk;
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_TOUCHPAD_LED, ctrl_param, NULL);
-}
-
-static void tpd_led_set(struct led_classdev *led_cdev,
-			enum led_brightness value)
+static void asus_wmi_led_write(struct asus_wmi *asus, enum asus_wmi_led_id id,
+			       int value)
+{
+	switch (id) {
+	case ASUS_WMI_LED_TPD:
+		asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_TOUCHPAD_LED, value,
+				      NULL);
+		break;
+	case ASUS_WMI_LED_KBD:
+		asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_KBD_BACKLIGHT,
+				      0x80 | (value & 0x7F), NULL);
+		break;
+	case ASUS_WMI_LED_WLAN:
+		asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_WIRELESS_LED, value,
+				      NULL);
+		break;
+	case ASUS_WMI_LED_LIGHTBAR:
+		asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_LIGHTBAR, value,
+				      NULL);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Must be called with led_lock held */
+static void __asus_wmi_led_apply(struct asus_wmi *asus,
+				 enum asus_wmi_led_id id)
+{
+	struct asus_wmi_led_slot *slot = &asus->led_slots[id];
+	int value;
+
+	/* A request coming in from here on marks the slot again */
+	WRITE_ONCE(slot->dirty, false);
+	smp_mb();
+	value = READ_ONCE(*slot->want);
+
+	if (slot->write)
+		slot->write(asus, value);
+	else
+		asus_wmi_led_write(asus, id, value);
+	WRITE_ONCE(slot->applied, value);
+	slot->last = jiffies;
+}
+
+static void asus_wmi_led_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     led_work.work);
+	struct asus_wmi_led_slot *slot;
+	unsigned long due, next = 0;
+	bool rearm = false;
+	int i;
+
+	mutex_lock(&asus->led_lock);
+	for (i = 0; i < ASUS_WMI_LED_COUNT; i++) {
+		slot = &asus->led_slots[i];
+		if (!slot->cdev || !READ_ONCE(slot->dirty))
+			continue;
+
+		due = slot->last + msecs_to_jiffies(slot->min_interval_ms);
+		if (slot->applied >= 0 && time_before(jiffies, due)) {
+			if (!rearm || time_before(due, next))
+				next = due;
+			rearm = true;
+			continue;
+		}
+
+		/*
+		 * Unchanged values are skipped, except for LEDs with their own
+		 * write: the RGB colour may have been changed through kbbl in
+		 * the meantime, and kbbl skips a colour that is shown already.
+		 */
+		WRITE_ONCE(slot->dirty, false);
+		smp_mb();
+		if (!slot->write && READ_ONCE(*slot->want) == slot->applied)
+			continue;
+
+		__asus_wmi_led_apply(asus, i);
+	}
+	mutex_unlock(&asus->led_lock);
+
+	if (rearm)
+		queue_delayed_work(asus->led_workqueue, &asus->led_work,
+				   max_t(long, next - jiffies, 0));
+}
+
+/* Records the requested value, safe to call from atomic context */
+static void asus_wmi_led_request(struct asus_wmi *asus,
+				 enum asus_wmi_led_id id, int value)
+{
+	struct asus_wmi_led_slot *slot = &asus->led_slots[id];
+	unsigned long due;
+
+	WRITE_ONCE(*slot->want, value);
+	smp_wmb();
+	WRITE_ONCE(slot->dirty, true);
+
+	due = slot->last + msecs_to_jiffies(slot->min_interval_ms);
+	if (READ_ONCE(slot->applied) < 0 || !time_before(jiffies, due))
+		mod_delayed_work(asus->led_workqueue, &asus->led_work, 0);
+	else
+		queue_delayed_work(asus->led_workqueue, &asus->led_work,
+				   due - jiffies);
+}
+
+/* While a request is pending, the firmware does not have the value yet */
+static bool asus_wmi_led_pending(struct asus_wmi *asus,
+				 enum asus_wmi_led_id id)
+{
+	struct asus_wmi_led_slot *slot = &asus->led_slots[id];
+
+	return READ_ONCE(slot->dirty);
+}
+
+/*
+ * The firmware may have reset the LEDs, write the next request in any case.
+ * Only requested values are written, so this does not touch the others.
+ */
+static void asus_wmi_led_forget(struct asus_wmi *asus)
+{
+	int i;
+
+	mutex_lock(&asus->led_lock);
+	for (i = 0; i < ASUS_WMI_LED_COUNT; i++)
+		WRITE_ONCE(asus->led_slots[i].applied, -1);
+	mutex_unlock(&asus->led_lock);
+}
+
+/* The attribute of each LED carries the slot index, see ASUS_WMI_LED_GROUPS */
+static struct asus_wmi_led_slot *asus_wmi_led_slot(struct device *dev,
+						   struct device_attribute *attr)
+{
+	struct dev_ext_attribute *ea;
+	struct asus_wmi *asus = dev_get_drvdata(dev->parent);
+
+	ea = container_of(attr, struct dev_ext_attribute, attr);
+	return &asus->led_slots[(unsigned long)ea->var];
+}
+
+static ssize_t min_interval_ms_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n",
+		       asus_wmi_led_slot(dev, attr)->min_interval_ms);
+}
+
+static ssize_t min_interval_ms_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev->parent);
+	unsigned int value;
+	int err;
+
+	err = kstrtouint(buf, 10, &value);
+	if (err)
+		return err;
+
+	mutex_lock(&asus->led_lock);
+	asus_wmi_led_slot(dev, attr)->min_interval_ms = value;
+	mutex_unlock(&asus->led_lock);
+
+	/* A shorter interval may let a waiting value through earlier */
+	mod_delayed_work(asus->led_workqueue, &asus->led_work, 0);
+
+	return count;
+}
+
+#define ASUS_WMI_LED_GROUPS(_name, _id)					\
+	static struct dev_ext_attribute _name##_led_min_interval_ms = {	\
+		.attr = __ATTR_RW(min_interval_ms),			\
+		.var = (void *)(_id),					\
+	};								\
+	static struct attribute *_name##_led_attrs[] = {		\
+		&_name##_led_min_interval_ms.attr.attr,			\
+		NULL							\
+	};								\
+	ATTRIBUTE_GROUPS(_name##_led)
+
+ASUS_WMI_LED_GROUPS(tpd, ASUS_WMI_LED_TPD);
+ASUS_WMI_LED_GROUPS(kbd, ASUS_WMI_LED_KBD);
+ASUS_WMI_LED_GROUPS(wlan, ASUS_WMI_LED_WLAN);
+ASUS_WMI_LED_GROUPS(lightbar, ASUS_WMI_LED_LIGHTBAR);
+#ifdef ASUS_KBBL_LED_MC
+ASUS_WMI_LED_GROUPS(kbbl_mc, ASUS_WMI_LED_RGB);
+#endif
+
+static void tpd_led_set(struct led_classdev *led_cdev,
+			enum led_brightness value)
 {
 	struct asus_wmi *asus;
 
 	asus = container_of(led_cdev, struct asus_wmi, tpd_led);
 
-	asus->tpd_led_wk = !!value;
-	queue_work(asus->led_workqueue, &asus->tpd_led_work);
+	asus_wmi_led_request(asus, ASUS_WMI_LED_TPD, !!value);
 }
 
 static int read_tpd_led_state(struct asus_wmi *asus)
@@ -612,12 +2159,80 @@ static enum led_brightness tpd_led_get(struct led_classdev *led_cdev)
 	return read_tpd_led_state(asus);
 }
 
-static void kbd_led_update(struct asus_wmi *asus)
+static void asus_wmi_coalesce_init(struct asus_wmi_coalesce *c,
+				   work_func_t func)
+{
+	spin_lock_init(&c->lock);
+	INIT_DELAYED_WORK(&c->work, func);
+}
+
+/* Returns true if the caller has to write now, false if the work will */
+static bool asus_wmi_coalesce_begin(struct asus_wmi_coalesce *c)
+{
+	bool now = false;
+
+	if (!hotkey_coalesce_ms)
+		return true;
+
+	spin_lock(&c->lock);
+	c->seq++;
+	if (!c->pending && time_after_eq(jiffies, c->window_end)) {
+		c->window_end = jiffies + msecs_to_jiffies(hotkey_coalesce_ms);
+		now = true;
+	} else if (!c->pending) {
+		c->pending = true;
+		schedule_delayed_work(&c->work, c->window_end - jiffies);
+	}
+	spin_unlock(&c->lock);
+
+	return now;
+}
+
+/* Called by the work after writing, rearms if the target moved meanwhile */
+static void asus_wmi_coalesce_end(struct asus_wmi_coalesce *c,
+				  unsigned int seq)
+{
+	unsigned long window = msecs_to_jiffies(hotkey_coalesce_ms);
+
+	spin_lock(&c->lock);
+	if (c->seq != seq) {
+		schedule_delayed_work(&c->work, window);
+	} else {
+		c->pending = false;
+		c->window_end = jiffies + window;
+	}
+	spin_unlock(&c->lock);
+}
+
+static unsigned int asus_wmi_coalesce_seq(struct asus_wmi_coalesce *c)
 {
-	int ctrl_param = 0;
+	unsigned int seq;
+
+	spin_lock(&c->lock);
+	seq = c->seq;
+	spin_unlock(&c->lock);
+
+	return seq;
+}
+
+/* While a write is pending, the firmware does not have the target yet */
+static bool asus_wmi_coalesce_pending(struct asus_wmi_coalesce *c)
+{
+	bool pending;
+
+	spin_lock(&c->lock);
+	pending = c->pending;
+	spin_unlock(&c->lock);
+
+	return pending;
+}
 
-	ctrl_param = 0x80 | (asus->kbd_led_wk & 0x7F);
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_KBD_BACKLIGHT, ctrl_param, NULL);
+/* Writes kbd_led_wk at once, for the hotkey and resume paths */
+static void kbd_led_update(struct asus_wmi *asus)
+{
+	mutex_lock(&asus->led_lock);
+	__asus_wmi_led_apply(asus, ASUS_WMI_LED_KBD);
+	mutex_unlock(&asus->led_lock);
 }
 
 static int kbd_led_read(struct asus_wmi *asus, int *level, int *env)
@@ -655,8 +2270,8 @@ static void do_kbd_led_set(struct led_classdev *led_cdev, int value)
 	asus = container_of(led_cdev, struct asus_wmi, kbd_led);
 	max_level = asus->kbd_led.max_brightness;
 
-	asus->kbd_led_wk = clamp_val(value, 0, max_level);
-	kbd_led_update(asus);
+	asus_wmi_led_request(asus, ASUS_WMI_LED_KBD,
+			     clamp_val(value, 0, max_level));
 }
 
 static void kbd_led_set(struct led_classdev *led_cdev,
@@ -669,11 +2284,25 @@ static void kbd_led_set(struct led_classdev *led_cdev,
 	do_kbd_led_set(led_cdev, value);
 }
 
+static void kbd_led_coalesce_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     kbd_led_coalesce.work.work);
+	unsigned int seq = asus_wmi_coalesce_seq(&asus->kbd_led_coalesce);
+
+	kbd_led_update(asus);
+	asus_wmi_coalesce_end(&asus->kbd_led_coalesce, seq);
+}
+
 static void kbd_led_set_by_kbd(struct asus_wmi *asus, enum led_brightness value)
 {
 	struct led_classdev *led_cdev = &asus->kbd_led;
+	int max_level = asus->kbd_led.max_brightness;
+
+	asus->kbd_led_wk = clamp_val(value, 0, max_level);
+	if (asus_wmi_coalesce_begin(&asus->kbd_led_coalesce))
+		kbd_led_update(asus);
 
-	do_kbd_led_set(led_cdev, value);
 	led_classdev_notify_brightness_hw_changed(led_cdev, asus->kbd_led_wk);
 }
 
@@ -684,6 +2313,10 @@ static enum led_brightness kbd_led_get(struct led_classdev *led_cdev)
 
 	asus = container_of(led_cdev, struct asus_wmi, kbd_led);
 
+	if (asus_wmi_coalesce_pending(&asus->kbd_led_coalesce) ||
+	    asus_wmi_led_pending(asus, ASUS_WMI_LED_KBD))
+		return asus->kbd_led_wk;
+
 	retval = kbd_led_read(asus, &value, NULL);
 	if (retval < 0)
 		return retval;
@@ -695,22 +2328,11 @@ static int wlan_led_unknown_state(struct asus_wmi *asus)
 {
 	u32 result;
 
-	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WIRELESS_LED, &result);
+	result = asus_wmi_dev_probe_value(asus, ASUS_WMI_DEVID_WIRELESS_LED);
 
 	return result & ASUS_WMI_DSTS_UNKNOWN_BIT;
 }
 
-static void wlan_led_update(struct work_struct *work)
-{
-	int ctrl_param;
-	struct asus_wmi *asus;
-
-	asus = container_of(work, struct asus_wmi, wlan_led_work);
-
-	ctrl_param = asus->wlan_led_wk;
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_WIRELESS_LED, ctrl_param, NULL);
-}
-
 static void wlan_led_set(struct led_classdev *led_cdev,
 			 enum led_brightness value)
 {
@@ -718,8 +2340,7 @@ static void wlan_led_set(struct led_classdev *led_cdev,
 
 	asus = container_of(led_cdev, struct asus_wmi, wlan_led);
 
-	asus->wlan_led_wk = !!value;
-	queue_work(asus->led_workqueue, &asus->wlan_led_work);
+	asus_wmi_led_request(asus, ASUS_WMI_LED_WLAN, !!value);
 }
 
 static enum led_brightness wlan_led_get(struct led_classdev *led_cdev)
@@ -733,17 +2354,6 @@ static enum led_brightness wlan_led_get(struct led_classdev *led_cdev)
 	return result & ASUS_WMI_DSTS_BRIGHTNESS_MASK;
 }
 
-static void lightbar_led_update(struct work_struct *work)
-{
-	struct asus_wmi *asus;
-	int ctrl_param;
-
-	asus = container_of(work, struct asus_wmi, lightbar_led_work);
-
-	ctrl_param = asus->lightbar_led_wk;
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_LIGHTBAR, ctrl_param, NULL);
-}
-
 static void lightbar_led_set(struct led_classdev *led_cdev,
 			     enum led_brightness value)
 {
@@ -751,8 +2361,7 @@ static void lightbar_led_set(struct led_classdev *led_cdev,
 
 	asus = container_of(led_cdev, struct asus_wmi, lightbar_led);
 
-	asus->lightbar_led_wk = !!value;
-	queue_work(asus->led_workqueue, &asus->lightbar_led_work);
+	asus_wmi_led_request(asus, ASUS_WMI_LED_LIGHTBAR, !!value);
 }
 
 static enum led_brightness lightbar_led_get(struct led_classdev *led_cdev)
@@ -768,30 +2377,53 @@ static enum led_brightness lightbar_led_get(struct led_classdev *led_cdev)
 
 static void asus_wmi_led_exit(struct asus_wmi *asus)
 {
+	int i;
+
+	cancel_delayed_work_sync(&asus->kbd_led_coalesce.work);
+
 	led_classdev_unregister(&asus->kbd_led);
 	led_classdev_unregister(&asus->tpd_led);
 	led_classdev_unregister(&asus->wlan_led);
 	led_classdev_unregister(&asus->lightbar_led);
 
-	if (asus->led_workqueue)
+	if (asus->led_workqueue) {
+		/* Let the last requests through, e.g. LEDs turned off */
+		mutex_lock(&asus->led_lock);
+		for (i = 0; i < ASUS_WMI_LED_COUNT; i++)
+			asus->led_slots[i].min_interval_ms = 0;
+		mutex_unlock(&asus->led_lock);
+
+		flush_delayed_work(&asus->led_work);
 		destroy_workqueue(asus->led_workqueue);
+	}
 }
 
 static int asus_wmi_led_init(struct asus_wmi *asus)
 {
-	int rv = 0, led_val;
+	int rv = 0, led_val, i;
 
 	asus->led_workqueue = create_singlethread_workqueue("led_workqueue");
 	if (!asus->led_workqueue)
 		return -ENOMEM;
 
-	if (read_tpd_led_state(asus) >= 0) {
-		INIT_WORK(&asus->tpd_led_work, tpd_led_update);
+	INIT_DELAYED_WORK(&asus->led_work, asus_wmi_led_work);
+	mutex_init(&asus->led_lock);
+	asus->led_slots[ASUS_WMI_LED_TPD].want = &asus->tpd_led_wk;
+	asus->led_slots[ASUS_WMI_LED_KBD].want = &asus->kbd_led_wk;
+	asus->led_slots[ASUS_WMI_LED_WLAN].want = &asus->wlan_led_wk;
+	asus->led_slots[ASUS_WMI_LED_LIGHTBAR].want = &asus->lightbar_led_wk;
+	for (i = 0; i < ASUS_WMI_LED_COUNT; i++) {
+		asus->led_slots[i].applied = -1;
+		asus->led_slots[i].min_interval_ms = led_min_interval_ms;
+	}
 
+	if (asus_wmi_dev_is_usable(asus, ASUS_WMI_DEVID_TOUCHPAD_LED)) {
+		asus->led_slots[ASUS_WMI_LED_TPD].cdev = &asus->tpd_led;
 		asus->tpd_led.name = "asus::touchpad";
 		asus->tpd_led.brightness_set = tpd_led_set;
 		asus->tpd_led.brightness_get = tpd_led_get;
 		asus->tpd_led.max_brightness = 1;
+		asus->tpd_led.groups = tpd_led_groups;
 
 		rv = led_classdev_register(&asus->platform_device->dev,
 					   &asus->tpd_led);
@@ -801,11 +2433,14 @@ static int asus_wmi_led_init(struct asus_wmi *asus)
 
 	if (!kbd_led_read(asus, &led_val, NULL)) {
 		asus->kbd_led_wk = led_val;
+		asus->led_slots[ASUS_WMI_LED_KBD].applied = led_val;
+		asus->led_slots[ASUS_WMI_LED_KBD].cdev = &asus->kbd_led;
 		asus->kbd_led.name = "asus::kbd_backlight";
 		asus->kbd_led.flags = LED_BRIGHT_HW_CHANGED;
 		asus->kbd_led.brightness_set = kbd_led_set;
 		asus->kbd_led.brightness_get = kbd_led_get;
 		asus->kbd_led.max_brightness = 3;
+		asus->kbd_led.groups = kbd_led_groups;
 
 		rv = led_classdev_register(&asus->platform_device->dev,
 					   &asus->kbd_led);
@@ -815,14 +2450,14 @@ static int asus_wmi_led_init(struct asus_wmi *asus)
 
 	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_WIRELESS_LED)
 			&& (asus->driver->quirks->wapf > 0)) {
-		INIT_WORK(&asus->wlan_led_work, wlan_led_update);
-
+		asus->led_slots[ASUS_WMI_LED_WLAN].cdev = &asus->wlan_led;
 		asus->wlan_led.name = "asus::wlan";
 		asus->wlan_led.brightness_set = wlan_led_set;
 		if (!wlan_led_unknown_state(asus))
 			asus->wlan_led.brightness_get = wlan_led_get;
 		asus->wlan_led.flags = LED_CORE_SUSPENDRESUME;
 		asus->wlan_led.max_brightness = 1;
+		asus->wlan_led.groups = wlan_led_groups;
 		asus->wlan_led.default_trigger = "asus-wlan";
 
 		rv = led_classdev_register(&asus->platform_device->dev,
@@ -832,12 +2467,12 @@ static int asus_wmi_led_init(struct asus_wmi *asus)
 	}
 
 	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_LIGHTBAR)) {
-		INIT_WORK(&asus->lightbar_led_work, lightbar_led_update);
-
+		asus->led_slots[ASUS_WMI_LED_LIGHTBAR].cdev = &asus->lightbar_led;
 		asus->lightbar_led.name = "asus::lightbar";
 		asus->lightbar_led.brightness_set = lightbar_led_set;
 		asus->lightbar_led.brightness_get = lightbar_led_get;
 		asus->lightbar_led.max_brightness = 1;
+		asus->lightbar_led.groups = lightbar_led_groups;
 
 		rv = led_classdev_register(&asus->platform_device->dev,
 					   &asus->lightbar_led);
@@ -873,6 +2508,18 @@ static ssize_t store_u8(u8 *value, const char *buf, int count)
 	return count;
 }
 
+static ssize_t kbbl_store_u8(struct asus_wmi *asus, u8 *value,
+			     const char *buf, int count)
+{
+	ssize_t ret;
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	ret = store_u8(value, buf, count);
+	mutex_unlock(&asus->kbbl_rgb.lock);
+
+	return ret;
+}
+
 static ssize_t kbbl_red_show(struct device *dev, struct device_attribute *attr,
 		char *buf)
 {
@@ -886,7 +2533,7 @@ static ssize_t kbbl_red_store(struct device *dev, struct device_attribute *attr,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_red, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_red, buf, count);
 }
 
 static ssize_t kbbl_green_show(struct device *dev,
@@ -902,7 +2549,7 @@ static ssize_t kbbl_green_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_green, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_green, buf, count);
 }
 
 static ssize_t kbbl_blue_show(struct device *dev, struct device_attribute *attr,
@@ -918,7 +2565,7 @@ static ssize_t kbbl_blue_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_blue, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_blue, buf, count);
 }
 
 static ssize_t kbbl_mode_show(struct device *dev, struct device_attribute *attr,
@@ -934,7 +2581,7 @@ static ssize_t kbbl_mode_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_mode, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_mode, buf, count);
 }
 
 static ssize_t kbbl_speed_show(struct device *dev,
@@ -950,7 +2597,7 @@ static ssize_t kbbl_speed_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_speed, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_speed, buf, count);
 }
 
 static ssize_t kbbl_flags_show(struct device *dev,
@@ -966,7 +2613,7 @@ static ssize_t kbbl_flags_store(struct device *dev,
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
 
-	return store_u8(&asus->kbbl_rgb.kbbl_set_flags, buf, count);
+	return kbbl_store_u8(asus, &asus->kbbl_rgb.kbbl_set_flags, buf, count);
 }
 
 static ssize_t kbbl_set_show(struct device *dev,
@@ -976,10 +2623,91 @@ static ssize_t kbbl_set_show(struct device *dev,
 			"Write to configure RGB keyboard backlight\n");
 }
 
-static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
+static bool kbbl_payload_same(const struct asus_kbbl_payload *payload,
+			      u32 arg0, u32 arg1)
+{
+	return payload->valid && payload->arg[0] == arg0 &&
+	       payload->arg[1] == arg1;
+}
+
+/* A persistent commit also has to go out if only the saved state differs */
+static bool kbbl_payload_needed(struct asus_kbbl_rgb *rgb, int call,
+				u32 arg0, u32 arg1, int persistent)
+{
+	if (!kbbl_payload_same(&rgb->shown[call], arg0, arg1))
+		return true;
+
+	return persistent && !kbbl_payload_same(&rgb->saved[call], arg0, arg1);
+}
+
+static void kbbl_payload_sent(struct asus_kbbl_rgb *rgb, int call,
+			      u32 arg0, u32 arg1, int persistent)
+{
+	struct asus_kbbl_payload payload = {
+		.arg = { arg0, arg1 },
+		.valid = true,
+	};
+
+	rgb->shown[call] = payload;
+	if (persistent) {
+		rgb->saved[call] = payload;
+		rgb->persistent_writes++;
+	} else {
+		rgb->temporary_writes++;
+	}
+}
+
+/* The firmware may have reverted to the saved state, e.g. across resume */
+static void kbbl_rgb_forget(struct asus_wmi *asus)
+{
+	int i;
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	for (i = 0; i < ASUS_KBBL_CALLS; i++) {
+		asus->kbbl_rgb.shown[i].valid = false;
+		asus->kbbl_rgb.saved[i].valid = false;
+	}
+	mutex_unlock(&asus->kbbl_rgb.lock);
+}
+
+/* Called with kbbl_rgb.lock held, sends one payload as it is */
+static int __kbbl_payload_write(struct asus_wmi *asus, int call,
+				u32 arg0, u32 arg1, int persistent)
 {
-	int err;
 	u32 retval;
+	int err;
+
+	asus->kbbl_rgb.shown[call].valid = false;
+
+	if (call == ASUS_KBBL_RGB)
+		err = asus_wmi_evaluate_method3(asus, ASUS_WMI_METHODID_DEVS,
+			ASUS_WMI_DEVID_KBD_RGB,
+			(persistent ? 0xb4 : 0xb3) | arg0, arg1, &retval);
+	else
+		err = asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_KBD_RGB2,
+			arg0 | (persistent ? 0x0100 : 0x0000), &retval);
+	if (err) {
+		pr_warn("RGB keyboard device %d, write error: %d\n",
+			call + 1, err);
+		return err;
+	}
+
+	if (retval != 1) {
+		pr_warn("RGB keyboard device %d, write error (retval): %x\n",
+			call + 1, retval);
+		return -EIO;
+	}
+
+	kbbl_payload_sent(&asus->kbbl_rgb, call, arg0, arg1, persistent);
+	return 0;
+}
+
+/* Called with kbbl_rgb.lock held */
+static int __kbbl_rgb_write(struct asus_wmi *asus, int persistent)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	int err;
+	u32 arg0, arg1;
 	u8 speed_byte;
 	u8 mode_byte;
 	u8 speed;
@@ -1018,39 +2746,27 @@ static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
 		break;
 	}
 
-	err = asus_wmi_evaluate_method3(ASUS_WMI_METHODID_DEVS,
-		ASUS_WMI_DEVID_KBD_RGB,
-		(persistent ? 0xb4 : 0xb3) |
-		(mode_byte << 8) |
-		(asus->kbbl_rgb.kbbl_set_red << 16) |
-		(asus->kbbl_rgb.kbbl_set_green << 24),
-		(asus->kbbl_rgb.kbbl_set_blue) |
-		(speed_byte << 8), &retval);
-	if (err) {
-		pr_warn("RGB keyboard device 1, write error: %d\n", err);
-		return err;
-	}
+	arg0 = (mode_byte << 8) |
+		(rgb->kbbl_set_red << 16) |
+		(rgb->kbbl_set_green << 24);
+	arg1 = (rgb->kbbl_set_blue) |
+		(speed_byte << 8);
 
-	if (retval != 1) {
-		pr_warn("RGB keyboard device 1, write error (retval): %x\n",
-				retval);
-		return -EIO;
+	if (kbbl_payload_needed(rgb, ASUS_KBBL_RGB, arg0, arg1, persistent)) {
+		err = __kbbl_payload_write(asus, ASUS_KBBL_RGB, arg0, arg1,
+					   persistent);
+		if (err)
+			return err;
 	}
 
-	err = asus_wmi_evaluate_method3(ASUS_WMI_METHODID_DEVS,
-		ASUS_WMI_DEVID_KBD_RGB2,
-		(0xbd) |
-		(asus->kbbl_rgb.kbbl_set_flags << 16) |
-		(persistent ? 0x0100 : 0x0000), 0, &retval);
-	if (err) {
-		pr_warn("RGB keyboard device 2, write error: %d\n", err);
-		return err;
-	}
+	arg0 = (0xbd) |
+		(rgb->kbbl_set_flags << 16);
 
-	if (retval != 1) {
-		pr_warn("RGB keyboard device 2, write error (retval): %x\n",
-				retval);
-		return -EIO;
+	if (kbbl_payload_needed(rgb, ASUS_KBBL_RGB2, arg0, 0, persistent)) {
+		err = __kbbl_payload_write(asus, ASUS_KBBL_RGB2, arg0, 0,
+					   persistent);
+		if (err)
+			return err;
 	}
 
 	asus->kbbl_rgb.kbbl_red = asus->kbbl_rgb.kbbl_set_red;
@@ -1058,102 +2774,1266 @@ static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
 	asus->kbbl_rgb.kbbl_blue = asus->kbbl_rgb.kbbl_set_blue;
 	asus->kbbl_rgb.kbbl_mode = mode;
 	asus->kbbl_rgb.kbbl_speed = speed;
+	asus->kbbl_rgb.kbbl_flags = rgb->kbbl_set_flags;
 
 	return 0;
 }
 
-static ssize_t kbbl_set_store(struct device *dev,
-		struct device_attribute *attr, const char *buf, size_t count)
-{
-	u8 value;
-	struct asus_wmi *asus;
-	int result;
+/*
+ * Called with kbbl_rgb.lock held, saves the state of a deferred commit.
+ * Saving also shows the saved state, so whatever a temporary write showed
+ * meanwhile (trigger, animation, idle dimming) is sent again afterwards.
+ * A failed save is retried by the work, unless retry is false.
+ */
+static void __kbbl_persist_flush(struct asus_wmi *asus, bool retry)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	struct asus_kbbl_state *state = &rgb->persist_state;
+	struct asus_kbbl_payload before[ASUS_KBBL_CALLS];
+	struct asus_kbbl_state staged = {
+		.red = rgb->kbbl_set_red,
+		.green = rgb->kbbl_set_green,
+		.blue = rgb->kbbl_set_blue,
+		.mode = rgb->kbbl_set_mode,
+		.speed = rgb->kbbl_set_speed,
+		.flags = rgb->kbbl_set_flags,
+	};
+	struct asus_kbbl_state committed = {
+		.red = rgb->kbbl_red,
+		.green = rgb->kbbl_green,
+		.blue = rgb->kbbl_blue,
+		.mode = rgb->kbbl_mode,
+		.speed = rgb->kbbl_speed,
+		.flags = rgb->kbbl_flags,
+	};
+	bool resent = false;
+	int err, i;
 
-	asus = dev_get_drvdata(dev);
-	result = store_u8(&value, buf, count);
-	if (result < 0)
-		return result;
+	if (!rgb->persist_pending)
+		return;
 
-	if (value == 1)
-		kbbl_rgb_write(asus, 1);
-	else if (value == 2)
-		kbbl_rgb_write(asus, 0);
+	rgb->persist_pending = false;
+	memcpy(before, rgb->shown, sizeof(before));
+
+	rgb->kbbl_set_red = state->red;
+	rgb->kbbl_set_green = state->green;
+	rgb->kbbl_set_blue = state->blue;
+	rgb->kbbl_set_mode = state->mode;
+	rgb->kbbl_set_speed = state->speed;
+	rgb->kbbl_set_flags = state->flags;
+
+	err = __kbbl_rgb_write(asus, 1);
+
+	rgb->kbbl_set_red = staged.red;
+	rgb->kbbl_set_green = staged.green;
+	rgb->kbbl_set_blue = staged.blue;
+	rgb->kbbl_set_mode = staged.mode;
+	rgb->kbbl_set_speed = staged.speed;
+	rgb->kbbl_set_flags = staged.flags;
+
+	for (i = 0; i < ASUS_KBBL_CALLS; i++) {
+		if (!before[i].valid ||
+		    kbbl_payload_same(&rgb->shown[i], before[i].arg[0],
+				      before[i].arg[1]))
+			continue;
+
+		__kbbl_payload_write(asus, i, before[i].arg[0],
+				     before[i].arg[1], 0);
+		resent = true;
+	}
 
-	return count;
-}
+	if (resent) {
+		rgb->kbbl_red = committed.red;
+		rgb->kbbl_green = committed.green;
+		rgb->kbbl_blue = committed.blue;
+		rgb->kbbl_mode = committed.mode;
+		rgb->kbbl_speed = committed.speed;
+		rgb->kbbl_flags = committed.flags;
+	}
 
-/* RGB values: 00 .. ff */
-static DEVICE_ATTR_RW(kbbl_red);
-static DEVICE_ATTR_RW(kbbl_green);
-static DEVICE_ATTR_RW(kbbl_blue);
+	if (!err)
+		return;
 
-/*
- * Color modes: 0 - static color, 1 - breathing, 2 - color cycle, 3 - strobing
- */
-static DEVICE_ATTR_RW(kbbl_mode);
+	if (retry && ++rgb->persist_retries < ASUS_KBBL_PERSIST_RETRIES) {
+		rgb->persist_pending = true;
+		mod_delayed_work(system_wq, &rgb->persist_work,
+				 msecs_to_jiffies(max(kbbl_persist_delay_ms,
+						      1000U)));
+		return;
+	}
 
-/* Speed for modes 1 and 2: 0 - slow, 1 - medium, 2 - fast */
-static DEVICE_ATTR_RW(kbbl_speed);
+	pr_warn("Unable to save the RGB keyboard settings: %d\n", err);
+}
 
-/*
- * Enable: 02 - on boot (until module load) | 08 - awake | 20 - sleep
- * (2a or ff to enable everything)
- *
- * Logically 80 would be shutdown, but no visible effects of this option
- * were observed so far
- */
-static DEVICE_ATTR_RW(kbbl_flags);
+static void kbbl_persist_flush(struct asus_wmi *asus)
+{
+	cancel_delayed_work_sync(&asus->kbbl_rgb.persist_work);
 
-/* Write data: 1 - permanently, 2 - temporarily (reset after reboot) */
-static DEVICE_ATTR_RW(kbbl_set);
+	mutex_lock(&asus->kbbl_rgb.lock);
+	__kbbl_persist_flush(asus, false);
+	mutex_unlock(&asus->kbbl_rgb.lock);
+}
 
-static struct attribute *rgbkb_sysfs_attributes[] = {
-	&dev_attr_kbbl_red.attr,
-	&dev_attr_kbbl_green.attr,
-	&dev_attr_kbbl_blue.attr,
-	&dev_attr_kbbl_mode.attr,
-	&dev_attr_kbbl_speed.attr,
-	&dev_attr_kbbl_flags.attr,
-	&dev_attr_kbbl_set.attr,
-	NULL,
-};
+static void kbbl_persist_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     kbbl_rgb.persist_work.work);
 
-static const struct attribute_group kbbl_attribute_group = {
-	.name = "kbbl",
-	.attrs = rgbkb_sysfs_attributes
-};
+	mutex_lock(&asus->kbbl_rgb.lock);
+	__kbbl_persist_flush(asus, true);
+	mutex_unlock(&asus->kbbl_rgb.lock);
+}
 
-static int kbbl_rgb_init(struct asus_wmi *asus)
+/*
+ * Called with kbbl_rgb.lock held for commits asked for by the user. With
+ * kbbl_persist_delay_ms a persistent commit is shown temporarily and only
+ * its last state is saved once the writes have settled.
+ */
+static int kbbl_rgb_commit(struct asus_wmi *asus, int persistent)
 {
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	unsigned int delay_ms = kbbl_persist_delay_ms;
 	int err;
 
-	err = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_KBD_RGB);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		else
-			return err;
+	if (!persistent || !delay_ms) {
+		if (persistent)
+			rgb->persist_pending = false;
+		return __kbbl_rgb_write(asus, persistent);
+	}
+
+	err = __kbbl_rgb_write(asus, 0);
+	if (err)
+		return err;
+
+	rgb->persist_state.red = rgb->kbbl_set_red;
+	rgb->persist_state.green = rgb->kbbl_set_green;
+	rgb->persist_state.blue = rgb->kbbl_set_blue;
+	rgb->persist_state.mode = rgb->kbbl_set_mode;
+	rgb->persist_state.speed = rgb->kbbl_set_speed;
+	rgb->persist_state.flags = rgb->kbbl_set_flags;
+	rgb->persist_pending = true;
+	rgb->persist_retries = 0;
+	mod_delayed_work(system_wq, &rgb->persist_work,
+			 msecs_to_jiffies(delay_ms));
+
+	return 0;
+}
+
+static int kbbl_rgb_write(struct asus_wmi *asus, int persistent)
+{
+	int err;
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	asus->kbbl_rgb.source = ASUS_KBBL_SOURCE_NONE;
+	err = kbbl_rgb_commit(asus, persistent);
+	mutex_unlock(&asus->kbbl_rgb.lock);
+
+	return err;
+}
+
+/* Eased progress through a keyframe, both in 1/1024 */
+static u32 kbbl_anim_ease(u8 easing, u32 p)
+{
+	switch (easing) {
+	case ASUS_KBBL_EASE_IN:
+		return p * p / 1024;
+	case ASUS_KBBL_EASE_OUT:
+		return 1024 - (1024 - p) * (1024 - p) / 1024;
+	case ASUS_KBBL_EASE_IN_OUT:
+		return p * p / 1024 * (3 * 1024 - 2 * p) / 1024;
+	case ASUS_KBBL_EASE_HOLD:
+		return 0;
+	case ASUS_KBBL_EASE_LINEAR:
+	default:
+		return p;
+	}
+}
+
+static u8 kbbl_anim_mix(u8 from, u8 to, u32 e)
+{
+	return from + ((int)to - from) * (int)e / 1024;
+}
+
+/* Called with kbbl_rgb.lock held */
+static void kbbl_anim_frame(struct asus_wmi *asus, ktime_t now)
+{
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	const struct asus_kbbl_keyframe *from, *to;
+	u32 t, p, e;
+	int i;
+
+	div_u64_rem(ktime_ms_delta(now, anim->start), anim->total_ms, &t);
+
+	for (i = 0; i < anim->n - 1 && t >= anim->frame[i].duration_ms; i++)
+		t -= anim->frame[i].duration_ms;
+
+	from = &anim->frame[i];
+	to = &anim->frame[(i + 1) % anim->n];
+	p = from->duration_ms ? min_t(u32, t * 1024 / from->duration_ms, 1024)
+			      : 1024;
+	e = kbbl_anim_ease(from->easing, p);
+
+	rgb->kbbl_set_red = kbbl_anim_mix(from->red, to->red, e);
+	rgb->kbbl_set_green = kbbl_anim_mix(from->green, to->green, e);
+	rgb->kbbl_set_blue = kbbl_anim_mix(from->blue, to->blue, e);
+	rgb->kbbl_set_mode = 0;
+}
+
+/* Called with kbbl_rgb.lock held, false if no new frame was pushed */
+static bool kbbl_stream_frame(struct asus_wmi *asus)
+{
+	struct asus_kbbl_stream *stream = &asus->kbbl_stream;
+	struct asus_kbbl_stream_ring *ring = stream->ring;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	struct asus_kbbl_stream_frame *frame;
+	u32 head;
+
+	head = smp_load_acquire(&ring->head);
+	if (head == stream->tail)
+		return false;
+
+	ring->overruns += head - stream->tail - 1;
+	stream->tail = head;
+	WRITE_ONCE(ring->tail, head);
+
+	frame = &ring->frame[(head - 1) % ASUS_KBBL_STREAM_FRAMES];
+	rgb->kbbl_set_red = READ_ONCE(frame->red);
+	rgb->kbbl_set_green = READ_ONCE(frame->green);
+	rgb->kbbl_set_blue = READ_ONCE(frame->blue);
+	rgb->kbbl_set_mode = 0;
+
+	return true;
+}
+
+/* Called with kbbl_rgb.lock held after a streamed frame was committed */
+static void kbbl_stream_account(struct asus_wmi *asus, ktime_t now)
+{
+	struct asus_kbbl_stream *stream = &asus->kbbl_stream;
+	s64 elapsed_us = ktime_us_delta(now, stream->fps_start);
+
+	stream->ring->frames++;
+	stream->fps_frames++;
+
+	if (elapsed_us >= USEC_PER_SEC) {
+		stream->ring->fps = div_u64((u64)stream->fps_frames *
+					    USEC_PER_SEC, elapsed_us);
+		stream->fps_frames = 0;
+		stream->fps_start = now;
+	}
+}
+
+static void kbbl_anim_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     kbbl_anim.work);
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	struct asus_kbbl_payload shown;
+	u32 min_us, delay_us;
+	ktime_t begin;
+	s64 cost;
+	int err;
+
+	if (!READ_ONCE(anim->running))
+		return;
+
+	mutex_lock(&rgb->lock);
+	begin = ktime_get();
+	if (!asus->kbbl_stream.ring) {
+		kbbl_anim_frame(asus, begin);
+	} else if (!kbbl_stream_frame(asus)) {
+		mutex_unlock(&rgb->lock);
+		cost = 0;
+		goto next;
 	}
 
-	err = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_KBD_RGB2);
+	shown = rgb->shown[ASUS_KBBL_RGB];
+	err = __kbbl_rgb_write(asus, 0);
+	cost = ktime_us_delta(ktime_get(), begin);
+
+	/* Frames equal to the last one do not reach the firmware */
+	if (!err && !kbbl_payload_same(&shown,
+				       rgb->shown[ASUS_KBBL_RGB].arg[0],
+				       rgb->shown[ASUS_KBBL_RGB].arg[1]))
+		anim->write_us = anim->write_us ?
+				 (anim->write_us * 7 + cost) / 8 : cost;
+	if (!err && asus->kbbl_stream.ring)
+		kbbl_stream_account(asus, ktime_get());
+	mutex_unlock(&rgb->lock);
+
 	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		else
-			return err;
+		pr_warn("RGB keyboard animation stopped: %d\n", err);
+		WRITE_ONCE(anim->running, false);
+		return;
+	}
+
+	anim->frames++;
+
+next:
+	/* Leave the firmware a fifth of the time to breathe */
+	min_us = USEC_PER_SEC / ASUS_KBBL_ANIM_MAX_FPS;
+	anim->period_us = max_t(u32, min_us, anim->write_us * 5 / 4);
+	delay_us = cost < anim->period_us ? anim->period_us - cost : 0;
+
+	if (READ_ONCE(anim->running))
+		hrtimer_start(&anim->timer, us_to_ktime(delay_us),
+			      HRTIMER_MODE_REL);
+}
+
+static enum hrtimer_restart kbbl_anim_timer(struct hrtimer *timer)
+{
+	struct asus_kbbl_anim *anim = container_of(timer,
+						   struct asus_kbbl_anim, timer);
+
+	/* Freezable, no frames are sent while suspended */
+	if (READ_ONCE(anim->running))
+		queue_work(system_freezable_wq, &anim->work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void kbbl_anim_stop(struct asus_wmi *asus)
+{
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+
+	WRITE_ONCE(anim->running, false);
+	hrtimer_cancel(&anim->timer);
+	cancel_work_sync(&anim->work);
+	hrtimer_cancel(&anim->timer);
+}
+
+static void kbbl_anim_start(struct asus_wmi *asus)
+{
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+
+	anim->start = ktime_get();
+	anim->frames = 0;
+	WRITE_ONCE(anim->running, true);
+	queue_work(system_freezable_wq, &anim->work);
+}
+
+static void kbbl_anim_init(struct asus_wmi *asus)
+{
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+
+	hrtimer_init(&anim->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	anim->timer.function = kbbl_anim_timer;
+	INIT_WORK(&anim->work, kbbl_anim_work);
+}
+
+static void kbbl_stream_dev_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct asus_kbbl_stream_dev, ref));
+}
+
+static int kbbl_stream_open(struct inode *inode, struct file *file)
+{
+	struct asus_kbbl_stream_dev *dev = container_of(file->private_data,
+						struct asus_kbbl_stream_dev,
+						misc);
+	struct asus_kbbl_stream *stream;
+	struct asus_kbbl_stream_ring *ring;
+	struct asus_wmi *asus;
+	int err = 0;
+
+	ring = (struct asus_kbbl_stream_ring *)get_zeroed_page(GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	mutex_lock(&dev->lock);
+	asus = dev->asus;
+	if (!asus) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	stream = &asus->kbbl_stream;
+	mutex_lock(&asus->kbbl_rgb.lock);
+	if (stream->ring) {
+		err = -EBUSY;
+	} else {
+		asus->kbbl_rgb.source = ASUS_KBBL_SOURCE_NONE;
+		stream->ring = ring;
+		stream->tail = 0;
+		stream->fps_frames = 0;
+		stream->fps_start = ktime_get();
+		asus->kbbl_anim.n = 0;
 	}
+	mutex_unlock(&asus->kbbl_rgb.lock);
+	if (err)
+		goto out;
+
+	/* Only now that the stream is ours, restart the consumer for it */
+	kbbl_anim_stop(asus);
+	kbbl_anim_start(asus);
+	kref_get(&dev->ref);
+
+out:
+	mutex_unlock(&dev->lock);
+	if (err)
+		free_page((unsigned long)ring);
+
+	return err;
+}
+
+/* Called with the device lock held */
+static void kbbl_stream_close(struct asus_wmi *asus)
+{
+	struct asus_kbbl_stream_ring *ring;
+
+	kbbl_anim_stop(asus);
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	ring = asus->kbbl_stream.ring;
+	asus->kbbl_stream.ring = NULL;
+	mutex_unlock(&asus->kbbl_rgb.lock);
+
+	/* A mapping still holds its own reference to the page */
+	free_page((unsigned long)ring);
+}
+
+static int kbbl_stream_release(struct inode *inode, struct file *file)
+{
+	struct asus_kbbl_stream_dev *dev = container_of(file->private_data,
+						struct asus_kbbl_stream_dev,
+						misc);
+
+	mutex_lock(&dev->lock);
+	if (dev->asus)
+		kbbl_stream_close(dev->asus);
+	mutex_unlock(&dev->lock);
+
+	kref_put(&dev->ref, kbbl_stream_dev_free);
+
+	return 0;
+}
+
+static int kbbl_stream_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct asus_kbbl_stream_dev *dev = container_of(file->private_data,
+						struct asus_kbbl_stream_dev,
+						misc);
+	int err = -ENODEV;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&dev->lock);
+	if (dev->asus && dev->asus->kbbl_stream.ring)
+		err = vm_insert_page(vma, vma->vm_start,
+				     virt_to_page(dev->asus->kbbl_stream.ring));
+	mutex_unlock(&dev->lock);
+
+	return err;
+}
+
+static const struct file_operations kbbl_stream_fops = {
+	.owner = THIS_MODULE,
+	.open = kbbl_stream_open,
+	.release = kbbl_stream_release,
+	.mmap = kbbl_stream_mmap,
+	.llseek = noop_llseek,
+};
+
+static void kbbl_stream_init(struct asus_wmi *asus)
+{
+	struct asus_kbbl_stream_dev *dev;
+	int err;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return;
+
+	kref_init(&dev->ref);
+	mutex_init(&dev->lock);
+	dev->asus = asus;
+	dev->misc.minor = MISC_DYNAMIC_MINOR;
+	dev->misc.name = "faustus_kbbl";
+	dev->misc.fops = &kbbl_stream_fops;
+	dev->misc.mode = 0600;
+
+	err = misc_register(&dev->misc);
+	if (err) {
+		pr_warn("Unable to register RGB stream device - %d\n", err);
+		kfree(dev);
+		return;
+	}
+
+	asus->kbbl_stream.dev = dev;
+}
+
+/*
+ * Stops the animation for a commit of another source, but not while a
+ * stream is open: the animation is what consumes its frames then.
+ */
+static int kbbl_anim_claim(struct asus_wmi *asus)
+{
+	struct asus_kbbl_stream_dev *dev = asus->kbbl_stream.dev;
+	int err = 0;
+
+	/* The ring only comes and goes under the device lock */
+	if (dev)
+		mutex_lock(&dev->lock);
+	if (asus->kbbl_stream.ring)
+		err = -EBUSY;
+	else
+		kbbl_anim_stop(asus);
+	if (dev)
+		mutex_unlock(&dev->lock);
+
+	return err;
+}
+
+/* A file that is still open is cut off from the driver */
+static void kbbl_stream_exit(struct asus_wmi *asus)
+{
+	struct asus_kbbl_stream_dev *dev = asus->kbbl_stream.dev;
+
+	if (!dev)
+		return;
+
+	misc_deregister(&dev->misc);
+
+	mutex_lock(&dev->lock);
+	if (asus->kbbl_stream.ring)
+		kbbl_stream_close(asus);
+	dev->asus = NULL;
+	mutex_unlock(&dev->lock);
+
+	asus->kbbl_stream.dev = NULL;
+	kref_put(&dev->ref, kbbl_stream_dev_free);
+}
+
+/* Takes the whole state at once, so concurrent writers cannot mix colours */
+/* Called with kbbl_rgb.lock held */
+static int __kbbl_state_write(struct asus_wmi *asus,
+			      const struct asus_kbbl_state *state)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+
+	rgb->source = ASUS_KBBL_SOURCE_NONE;
+	rgb->kbbl_set_red = state->red;
+	rgb->kbbl_set_green = state->green;
+	rgb->kbbl_set_blue = state->blue;
+	rgb->kbbl_set_mode = state->mode;
+	rgb->kbbl_set_speed = state->speed;
+	rgb->kbbl_set_flags = state->flags;
+
+	return kbbl_rgb_commit(asus, state->persist);
+}
+
+static int kbbl_state_commit(struct asus_wmi *asus,
+			     const struct asus_kbbl_state *state)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	int err = 0;
+
+	if (state->mode > 3 || state->speed > 2 || state->persist > 1)
+		return -EINVAL;
+
+	err = kbbl_anim_claim(asus);
+	if (err)
+		return err;
+
+	mutex_lock(&rgb->lock);
+	if (async_writes) {
+		/* Stores to kbbl_set_* until then must not change it */
+		rgb->async_state = *state;
+		asus_async_queue(asus, ASUS_ASYNC_KBBL, ASUS_KBBL_ASYNC_STATE);
+	} else {
+		err = __kbbl_state_write(asus, state);
+	}
+	mutex_unlock(&rgb->lock);
+
+	return err;
+}
+
+static void kbbl_state_get(struct asus_wmi *asus,
+			   struct asus_kbbl_state *state)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+
+	memset(state, 0, sizeof(*state));
+
+	mutex_lock(&rgb->lock);
+	state->red = rgb->kbbl_red;
+	state->green = rgb->kbbl_green;
+	state->blue = rgb->kbbl_blue;
+	state->mode = rgb->kbbl_mode;
+	state->speed = rgb->kbbl_speed;
+	state->flags = rgb->kbbl_flags;
+	mutex_unlock(&rgb->lock);
+}
+
+static ssize_t kbbl_state_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_state state;
+
+	kbbl_state_get(asus, &state);
+
+	return scnprintf(buf, PAGE_SIZE, "%02x%02x%02x %u %u %02x\n",
+			 state.red, state.green, state.blue, state.mode,
+			 state.speed, state.flags);
+}
+
+static ssize_t kbbl_state_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_state state = { 0 };
+	unsigned int color;
+	int err;
+
+	if (sscanf(buf, "%6x %hhu %hhu %hhx %hhu", &color, &state.mode,
+		   &state.speed, &state.flags, &state.persist) != 5)
+		return -EINVAL;
+
+	state.red = color >> 16;
+	state.green = color >> 8;
+	state.blue = color;
+
+	err = kbbl_state_commit(asus, &state);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static ssize_t kbbl_state_raw_read(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_state state;
+
+	if (off >= sizeof(state))
+		return 0;
+
+	kbbl_state_get(asus, &state);
+
+	count = min_t(size_t, count, sizeof(state) - off);
+	memcpy(buf, (u8 *)&state + off, count);
+
+	return count;
+}
+
+static ssize_t kbbl_state_raw_write(struct file *filp, struct kobject *kobj,
+		struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_state state;
+	int err;
+
+	if (off != 0 || count != sizeof(state))
+		return -EINVAL;
+
+	memcpy(&state, buf, sizeof(state));
+	err = kbbl_state_commit(asus, &state);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static ssize_t kbbl_set_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	u8 value;
+	struct asus_wmi *asus;
+	int result;
+
+	asus = dev_get_drvdata(dev);
+	result = store_u8(&value, buf, count);
+	if (result < 0)
+		return result;
+
+	if (value != 1 && value != 2)
+		return count;
+
+	result = kbbl_anim_claim(asus);
+	if (result)
+		return result;
+
+	if (async_writes)
+		asus_async_queue(asus, ASUS_ASYNC_KBBL, value);
+	else
+		kbbl_rgb_write(asus, value == 1);
+
+	return count;
+}
+
+static ssize_t kbbl_anim_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+	const struct asus_kbbl_keyframe *kf;
+	int len = 0;
+	int i;
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	for (i = 0; i < anim->n; i++) {
+		kf = &anim->frame[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%02x%02x%02x:%u:%c ", kf->red, kf->green,
+				 kf->blue, kf->duration_ms, kf->easing);
+	}
+	if (anim->n)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	if (asus->kbbl_stream.ring)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "stream frames %u overruns %u fps %u\n",
+				 asus->kbbl_stream.ring->frames,
+				 asus->kbbl_stream.ring->overruns,
+				 asus->kbbl_stream.ring->fps);
+	mutex_unlock(&asus->kbbl_rgb.lock);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			 "running %d frames %u write_us %u fps %lu\n",
+			 READ_ONCE(anim->running), anim->frames, anim->write_us,
+			 anim->period_us ? USEC_PER_SEC / anim->period_us : 0);
+
+	return len;
+}
+
+static ssize_t kbbl_anim_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_anim *anim = &asus->kbbl_anim;
+	struct asus_kbbl_keyframe frame[ASUS_KBBL_ANIM_FRAMES];
+	unsigned int color, duration;
+	u32 total_ms = 0;
+	char easing;
+	int n = 0, used;
+	int fields;
+	int err;
+
+	while (*(buf = skip_spaces(buf))) {
+		easing = ASUS_KBBL_EASE_LINEAR;
+		used = 0;
+		fields = sscanf(buf, "%6x:%u%n:%c%n", &color, &duration, &used,
+				&easing, &used);
+		if (fields < 2 || n == ASUS_KBBL_ANIM_FRAMES || !duration ||
+		    duration > ASUS_KBBL_ANIM_MAX_MS)
+			return -EINVAL;
+
+		switch (easing) {
+		case ASUS_KBBL_EASE_LINEAR:
+		case ASUS_KBBL_EASE_IN:
+		case ASUS_KBBL_EASE_OUT:
+		case ASUS_KBBL_EASE_IN_OUT:
+		case ASUS_KBBL_EASE_HOLD:
+			break;
+		default:
+			return -EINVAL;
+		}
+
+		frame[n].red = color >> 16;
+		frame[n].green = color >> 8;
+		frame[n].blue = color;
+		frame[n].easing = easing;
+		frame[n].duration_ms = duration;
+		total_ms += duration;
+		n++;
+		buf += used;
+	}
+
+	err = kbbl_anim_claim(asus);
+	if (err)
+		return err;
+
+	if (!n)
+		return count;
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	asus->kbbl_rgb.source = ASUS_KBBL_SOURCE_NONE;
+	memcpy(anim->frame, frame, sizeof(frame[0]) * n);
+	anim->n = n;
+	anim->total_ms = total_ms;
+	mutex_unlock(&asus->kbbl_rgb.lock);
+
+	kbbl_anim_start(asus);
+
+	return count;
+}
+
+/* RGB values: 00 .. ff */
+static DEVICE_ATTR_RW(kbbl_red);
+static DEVICE_ATTR_RW(kbbl_green);
+static DEVICE_ATTR_RW(kbbl_blue);
+
+/*
+ * Color modes: 0 - static color, 1 - breathing, 2 - color cycle, 3 - strobing
+ */
+static DEVICE_ATTR_RW(kbbl_mode);
+
+/* Speed for modes 1 and 2: 0 - slow, 1 - medium, 2 - fast */
+static DEVICE_ATTR_RW(kbbl_speed);
+
+/*
+ * Enable: 02 - on boot (until module load) | 08 - awake | 20 - sleep
+ * (2a or ff to enable everything)
+ *
+ * Logically 80 would be shutdown, but no visible effects of this option
+ * were observed so far
+ */
+static DEVICE_ATTR_RW(kbbl_flags);
+
+/* Write data: 1 - permanently, 2 - temporarily (reset after reboot) */
+static DEVICE_ATTR_RW(kbbl_set);
+
+/*
+ * Everything in one write: "RRGGBB mode speed flags persist", persist is
+ * 1 - permanently, 0 - temporarily. Reads back "RRGGBB mode speed flags".
+ */
+static DEVICE_ATTR_RW(kbbl_state);
+
+/*
+ * Keyframes "RRGGBB:ms[:easing] ...", looped until another colour is set
+ * or an empty string is written. Each fades to the next one with easing
+ * l - linear (default), i - ease in, o - ease out, s - ease in and out,
+ * h - hold. Reads back the keyframes and frame statistics.
+ */
+static DEVICE_ATTR_RW(kbbl_anim);
+
+/* Same as kbbl_state as struct asus_kbbl_state */
+static BIN_ATTR_RW(kbbl_state_raw, sizeof(struct asus_kbbl_state));
+
+static struct attribute *rgbkb_sysfs_attributes[] = {
+	&dev_attr_kbbl_red.attr,
+	&dev_attr_kbbl_green.attr,
+	&dev_attr_kbbl_blue.attr,
+	&dev_attr_kbbl_mode.attr,
+	&dev_attr_kbbl_speed.attr,
+	&dev_attr_kbbl_flags.attr,
+	&dev_attr_kbbl_set.attr,
+	&dev_attr_kbbl_state.attr,
+	&dev_attr_kbbl_anim.attr,
+	NULL,
+};
+
+static struct bin_attribute *rgbkb_sysfs_bin_attributes[] = {
+	&bin_attr_kbbl_state_raw,
+	NULL,
+};
+
+static const struct attribute_group kbbl_attribute_group = {
+	.name = "kbbl",
+	.attrs = rgbkb_sysfs_attributes,
+	.bin_attrs = rgbkb_sysfs_bin_attributes,
+};
+
+#ifdef ASUS_KBBL_LED_MC
+/*
+ * The LED brightness scales the intensities into a static colour. Only
+ * the colour call reaches the firmware when the brightness changes, and
+ * like the other LEDs it goes through the LED worker.
+ */
+static void kbbl_mc_write(struct asus_wmi *asus, int value)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+
+	if (kbbl_anim_claim(asus))
+		return;
+
+	mutex_lock(&rgb->lock);
+	rgb->source = ASUS_KBBL_SOURCE_NONE;
+	rgb->kbbl_set_red = (value >> 16) & 0xff;
+	rgb->kbbl_set_green = (value >> 8) & 0xff;
+	rgb->kbbl_set_blue = value & 0xff;
+	rgb->kbbl_set_mode = 0;
+	__kbbl_rgb_write(asus, 0);
+	mutex_unlock(&rgb->lock);
+}
+
+static void kbbl_mc_set(struct led_classdev *led_cdev,
+			enum led_brightness brightness)
+{
+	struct led_classdev_mc *mc = lcdev_to_mccdev(led_cdev);
+	struct asus_wmi *asus = container_of(mc, struct asus_wmi, kbbl_mc);
+
+	led_mc_calc_color_components(mc, brightness);
+
+	asus_wmi_led_request(asus, ASUS_WMI_LED_RGB,
+			     (asus->kbbl_subled[0].brightness << 16) |
+			     (asus->kbbl_subled[1].brightness << 8) |
+			     asus->kbbl_subled[2].brightness);
+}
+
+static void kbbl_mc_init(struct asus_wmi *asus)
+{
+	static const int colors[] = {
+		LED_COLOR_ID_RED, LED_COLOR_ID_GREEN, LED_COLOR_ID_BLUE
+	};
+	struct asus_wmi_led_slot *slot = &asus->led_slots[ASUS_WMI_LED_RGB];
+	struct led_classdev_mc *mc = &asus->kbbl_mc;
+	int err;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(colors); i++) {
+		asus->kbbl_subled[i].color_index = colors[i];
+		asus->kbbl_subled[i].channel = i;
+		asus->kbbl_subled[i].intensity = 255;
+	}
+
+	mc->subled_info = asus->kbbl_subled;
+	mc->num_colors = ARRAY_SIZE(colors);
+	mc->led_cdev.name = "asus:rgb:kbd_backlight";
+	mc->led_cdev.max_brightness = 255;
+	mc->led_cdev.brightness_set = kbbl_mc_set;
+	mc->led_cdev.groups = kbbl_mc_led_groups;
+
+	slot->want = &asus->kbbl_mc_wk;
+	slot->write = kbbl_mc_write;
+	slot->cdev = &mc->led_cdev;
+
+	err = led_classdev_multicolor_register(&asus->platform_device->dev,
+					       mc);
+	if (err) {
+		pr_warn("Unable to register RGB keyboard LED - %d\n", err);
+		slot->cdev = NULL;
+		return;
+	}
+
+	asus->kbbl_mc_registered = true;
+}
+
+static void kbbl_mc_exit(struct asus_wmi *asus)
+{
+	struct asus_wmi_led_slot *slot = &asus->led_slots[ASUS_WMI_LED_RGB];
+
+	if (!asus->kbbl_mc_registered)
+		return;
+
+	led_classdev_multicolor_unregister(&asus->kbbl_mc);
+
+	/* Write the last request now, the stream goes away next */
+	mutex_lock(&asus->led_lock);
+	if (slot->dirty)
+		__asus_wmi_led_apply(asus, ASUS_WMI_LED_RGB);
+	slot->cdev = NULL;
+	mutex_unlock(&asus->led_lock);
+}
+#else
+static void kbbl_mc_init(struct asus_wmi *asus) { }
+static void kbbl_mc_exit(struct asus_wmi *asus) { }
+#endif
+
+static int kbbl_rgb_init(struct asus_wmi *asus)
+{
+	int err;
+
+	mutex_init(&asus->kbbl_rgb.lock);
+	INIT_DELAYED_WORK(&asus->kbbl_rgb.persist_work, kbbl_persist_work);
+	kbbl_anim_init(asus);
+
+	if (!asus_wmi_dev_is_usable(asus, ASUS_WMI_DEVID_KBD_RGB) ||
+	    !asus_wmi_dev_is_usable(asus, ASUS_WMI_DEVID_KBD_RGB2))
+		return 0;
 
 	asus->kbbl_rgb_available = true;
-	return sysfs_create_group(&asus->platform_device->dev.kobj,
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
 			&kbbl_attribute_group);
+	if (err)
+		return err;
+
+	kbbl_stream_init(asus);
+	kbbl_mc_init(asus);
+	return 0;
 }
 
 static void kbbl_rgb_exit(struct asus_wmi *asus)
 {
 	if (asus->kbbl_rgb_available) {
+		kbbl_mc_exit(asus);
+		kbbl_stream_exit(asus);
 		sysfs_remove_group(&asus->platform_device->dev.kobj,
 				&kbbl_attribute_group);
+		kbbl_anim_stop(asus);
+		kbbl_persist_flush(asus);
+	}
+}
+
+/* Idle timeout ***************************************************************/
+
+/*
+ * Called with kbbl_rgb.lock held. Shows a colour in the committed mode
+ * temporarily, without touching the staged or the committed settings.
+ */
+static int __kbbl_rgb_show(struct asus_wmi *asus, u8 red, u8 green, u8 blue)
+{
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	struct asus_kbbl_state staged = {
+		.red = rgb->kbbl_set_red,
+		.green = rgb->kbbl_set_green,
+		.blue = rgb->kbbl_set_blue,
+		.mode = rgb->kbbl_set_mode,
+		.speed = rgb->kbbl_set_speed,
+		.flags = rgb->kbbl_set_flags,
+	};
+	struct asus_kbbl_state committed = {
+		.red = rgb->kbbl_red,
+		.green = rgb->kbbl_green,
+		.blue = rgb->kbbl_blue,
+		.mode = rgb->kbbl_mode,
+		.speed = rgb->kbbl_speed,
+		.flags = rgb->kbbl_flags,
+	};
+	int err;
+
+	rgb->kbbl_set_red = red;
+	rgb->kbbl_set_green = green;
+	rgb->kbbl_set_blue = blue;
+	rgb->kbbl_set_mode = committed.mode;
+	rgb->kbbl_set_speed = committed.speed;
+	rgb->kbbl_set_flags = committed.flags;
+
+	err = __kbbl_rgb_write(asus, 0);
+
+	rgb->kbbl_set_red = staged.red;
+	rgb->kbbl_set_green = staged.green;
+	rgb->kbbl_set_blue = staged.blue;
+	rgb->kbbl_set_mode = staged.mode;
+	rgb->kbbl_set_speed = staged.speed;
+	rgb->kbbl_set_flags = staged.flags;
+
+	rgb->kbbl_red = committed.red;
+	rgb->kbbl_green = committed.green;
+	rgb->kbbl_blue = committed.blue;
+	rgb->kbbl_mode = committed.mode;
+	rgb->kbbl_speed = committed.speed;
+	rgb->kbbl_flags = committed.flags;
+
+	return err;
+}
+
+static void asus_wmi_idle_dim(struct asus_wmi *asus)
+{
+	struct asus_wmi_idle *idle = &asus->idle;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	unsigned int percent = min_t(uint, idle_rgb_percent, 100);
+
+	/* Under led_lock, and not over a level that is still being set */
+	idle->kbd_level = -1;
+	mutex_lock(&asus->led_lock);
+	if (!IS_ERR_OR_NULL(asus->kbd_led.dev) &&
+	    !asus_wmi_led_pending(asus, ASUS_WMI_LED_KBD) &&
+	    READ_ONCE(asus->kbd_led_wk) > idle_kbd_level) {
+		idle->kbd_level = READ_ONCE(asus->kbd_led_wk);
+		WRITE_ONCE(asus->kbd_led_wk, idle_kbd_level);
+		__asus_wmi_led_apply(asus, ASUS_WMI_LED_KBD);
+	}
+	mutex_unlock(&asus->led_lock);
+
+	/* Animations, streams and triggers keep their own colours */
+	idle->rgb_dimmed = false;
+	if (!asus->kbbl_rgb_available || READ_ONCE(asus->kbbl_anim.running))
+		return;
+
+	mutex_lock(&rgb->lock);
+	if (rgb->source == ASUS_KBBL_SOURCE_NONE &&
+	    rgb->shown[ASUS_KBBL_RGB].valid) {
+		idle->rgb_before = rgb->shown[ASUS_KBBL_RGB];
+		idle->rgb_dimmed = !__kbbl_rgb_show(asus,
+					rgb->kbbl_red * percent / 100,
+					rgb->kbbl_green * percent / 100,
+					rgb->kbbl_blue * percent / 100);
+		idle->rgb_dim = rgb->shown[ASUS_KBBL_RGB];
+	}
+	mutex_unlock(&rgb->lock);
+}
+
+static void asus_wmi_idle_restore(struct asus_wmi *asus)
+{
+	struct asus_wmi_idle *idle = &asus->idle;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+
+	/* Unless the level was changed, or is being changed, while idle */
+	mutex_lock(&asus->led_lock);
+	if (idle->kbd_level >= 0 &&
+	    !asus_wmi_led_pending(asus, ASUS_WMI_LED_KBD) &&
+	    READ_ONCE(asus->kbd_led_wk) == idle_kbd_level) {
+		WRITE_ONCE(asus->kbd_led_wk, idle->kbd_level);
+		__asus_wmi_led_apply(asus, ASUS_WMI_LED_KBD);
+	}
+	mutex_unlock(&asus->led_lock);
+
+	if (!idle->rgb_dimmed)
+		return;
+
+	/* Anything written while dimmed, by the user or not, is kept */
+	mutex_lock(&rgb->lock);
+	if (kbbl_payload_same(&rgb->shown[ASUS_KBBL_RGB],
+			      idle->rgb_dim.arg[0], idle->rgb_dim.arg[1]))
+		__kbbl_payload_write(asus, ASUS_KBBL_RGB,
+				     idle->rgb_before.arg[0],
+				     idle->rgb_before.arg[1], 0);
+	mutex_unlock(&rgb->lock);
+}
+
+static void asus_wmi_idle_dim_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     idle.dim_work.work);
+	struct asus_wmi_idle *idle = &asus->idle;
+	unsigned long timeout = idle_timeout * HZ;
+	unsigned long since;
+
+	if (!timeout)
+		return;
+
+	mutex_lock(&idle->lock);
+	since = jiffies - READ_ONCE(idle->last_input);
+	if (since < timeout) {
+		schedule_delayed_work(&idle->dim_work, timeout - since);
+	} else if (!idle->dimmed) {
+		WRITE_ONCE(idle->dimmed, true);
+		asus_wmi_idle_dim(asus);
+	}
+	mutex_unlock(&idle->lock);
+}
+
+static void asus_wmi_idle_restore_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     idle.restore_work);
+	struct asus_wmi_idle *idle = &asus->idle;
+
+	mutex_lock(&idle->lock);
+	if (idle->dimmed) {
+		asus_wmi_idle_restore(asus);
+		WRITE_ONCE(idle->dimmed, false);
 	}
+	mutex_unlock(&idle->lock);
+
+	if (idle_timeout)
+		schedule_delayed_work(&idle->dim_work, idle_timeout * HZ);
+}
+
+/*
+ * Runs in input event context, only notes the time. A timeout set at
+ * runtime starts counting from the next input.
+ */
+static void asus_wmi_idle_event(struct input_handle *handle,
+				unsigned int type, unsigned int code,
+				int value)
+{
+	struct asus_wmi_idle *idle = handle->private;
+
+	if (type != EV_KEY && type != EV_REL && type != EV_ABS)
+		return;
+
+	WRITE_ONCE(idle->last_input, jiffies);
+	if (READ_ONCE(idle->dimmed))
+		queue_work(system_highpri_wq, &idle->restore_work);
+	else if (idle_timeout && !delayed_work_pending(&idle->dim_work))
+		schedule_delayed_work(&idle->dim_work, idle_timeout * HZ);
+}
+
+static int asus_wmi_idle_connect(struct input_handler *handler,
+				 struct input_dev *dev,
+				 const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int err;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "faustus_idle";
+	handle->private = handler->private;
+
+	err = input_register_handle(handle);
+	if (err)
+		goto fail_register;
+
+	err = input_open_device(handle);
+	if (err)
+		goto fail_open;
+
+	return 0;
+
+fail_open:
+	input_unregister_handle(handle);
+fail_register:
+	kfree(handle);
+	return err;
+}
+
+static void asus_wmi_idle_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id asus_wmi_idle_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static void asus_wmi_idle_init(struct asus_wmi *asus)
+{
+	struct asus_wmi_idle *idle = &asus->idle;
+	int err;
+
+	mutex_init(&idle->lock);
+	INIT_DELAYED_WORK(&idle->dim_work, asus_wmi_idle_dim_work);
+	INIT_WORK(&idle->restore_work, asus_wmi_idle_restore_work);
+	idle->last_input = jiffies;
+
+	if (IS_ERR_OR_NULL(asus->kbd_led.dev) && !asus->kbbl_rgb_available)
+		return;
+
+	idle->handler.name = "faustus_idle";
+	idle->handler.event = asus_wmi_idle_event;
+	idle->handler.connect = asus_wmi_idle_connect;
+	idle->handler.disconnect = asus_wmi_idle_disconnect;
+	idle->handler.id_table = asus_wmi_idle_ids;
+	idle->handler.private = idle;
+
+	err = input_register_handler(&idle->handler);
+	if (err) {
+		pr_warn("Unable to watch input for idle timeout - %d\n", err);
+		return;
+	}
+
+	idle->registered = true;
+	if (idle_timeout)
+		schedule_delayed_work(&idle->dim_work, idle_timeout * HZ);
+}
+
+static void asus_wmi_idle_exit(struct asus_wmi *asus)
+{
+	struct asus_wmi_idle *idle = &asus->idle;
+
+	if (!idle->registered)
+		return;
+
+	input_unregister_handler(&idle->handler);
+	idle->registered = false;
+	/* The restore work arms the dim work, so it goes first */
+	cancel_work_sync(&idle->restore_work);
+	cancel_delayed_work_sync(&idle->dim_work);
+
+	mutex_lock(&idle->lock);
+	if (idle->dimmed) {
+		asus_wmi_idle_restore(asus);
+		idle->dimmed = false;
+	}
+	mutex_unlock(&idle->lock);
 }
 
 /* RF *************************************************************************/
@@ -1178,6 +4058,8 @@ static void asus_rfkill_hotplug(struct asus_wmi *asus)
 	bool absent;
 	u32 l;
 
+	asus_wmi_forget_state(asus, ASUS_WMI_DEVID_WLAN);
+
 	mutex_lock(&asus->wmi_lock);
 	blocked = asus_wlan_rfkill_blocked(asus);
 	mutex_unlock(&asus->wmi_lock);
@@ -1368,7 +4250,7 @@ static int asus_rfkill_set(void *data, bool blocked)
 	     priv->asus->driver->wlan_ctrl_by_user)
 		dev_id = ASUS_WMI_DEVID_WLAN_LED;
 
-	return asus_wmi_set_devstate(dev_id, ctrl_param, NULL);
+	return asus_wmi_set_devstate(priv->asus, dev_id, ctrl_param, NULL);
 }
 
 static void asus_rfkill_query(struct rfkill *rfkill, void *data)
@@ -1417,9 +4299,13 @@ static int asus_new_rfkill(struct asus_wmi *asus,
 			   struct asus_rfkill *arfkill,
 			   const char *name, enum rfkill_type type, int dev_id)
 {
-	int result = asus_wmi_get_devstate_simple(asus, dev_id);
 	struct rfkill **rfkill = &arfkill->rfkill;
+	int result;
+
+	if (!asus_wmi_dev_is_usable(asus, dev_id))
+		return -ENODEV;
 
+	result = asus_wmi_get_devstate_simple(asus, dev_id);
 	if (result < 0)
 		return result;
 
@@ -1604,9 +4490,9 @@ static void asus_wmi_set_xusb2pr(struct asus_wmi *asus)
  * Some devices dont support or have borcken get_als method
  * but still support set method.
  */
-static void asus_wmi_set_als(void)
+static void asus_wmi_set_als(struct asus_wmi *asus)
 {
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_ALS_ENABLE, 1, NULL);
+	asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_ALS_ENABLE, 1, NULL);
 }
 
 /* Hwmon device ***************************************************************/
@@ -1627,7 +4513,7 @@ static int asus_agfn_fan_speed_read(struct asus_wmi *asus, int fan,
 	if (fan != 1)
 		return -EINVAL;
 
-	status = asus_wmi_evaluate_method_agfn(input);
+	status = asus_wmi_evaluate_method_agfn(asus, input);
 
 	if (status || args.agfn.err)
 		return -ENXIO;
@@ -1655,7 +4541,7 @@ static int asus_agfn_fan_speed_write(struct asus_wmi *asus, int fan,
 	if (fan != 1 && fan != 0)
 		return -EINVAL;
 
-	status = asus_wmi_evaluate_method_agfn(input);
+	status = asus_wmi_evaluate_method_agfn(asus, input);
 
 	if (status || args.agfn.err)
 		return -ENXIO;
@@ -1680,10 +4566,11 @@ static bool asus_wmi_has_agfn_fan(struct asus_wmi *asus)
 	if (status != 0)
 		return false;
 
-	status = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_CTRL, &value);
-	if (status != 0)
+	if (!asus_wmi_dev_is_readable(asus, ASUS_WMI_DEVID_FAN_CTRL))
 		return false;
 
+	value = asus_wmi_dev_probe_value(asus, ASUS_WMI_DEVID_FAN_CTRL);
+
 	/*
 	 * We need to find a better way, probably using sfun,
 	 * bits or spec ...
@@ -1703,7 +4590,8 @@ static int asus_fan_set_auto(struct asus_wmi *asus)
 
 	switch (asus->fan_type) {
 	case FAN_TYPE_SPEC83:
-		status = asus_wmi_set_devstate(ASUS_WMI_DEVID_CPU_FAN_CTRL,
+		status = asus_wmi_set_devstate(asus,
+					       ASUS_WMI_DEVID_CPU_FAN_CTRL,
 					       0, &retval);
 		if (status)
 			return status;
@@ -1776,6 +4664,11 @@ static ssize_t pwm1_store(struct device *dev,
 
 	value = clamp(value, 0, 255);
 
+	if (async_writes) {
+		asus_async_queue(asus, ASUS_ASYNC_PWM1, value);
+		return count;
+	}
+
 	state = asus_agfn_fan_speed_write(asus, 1, &value);
 	if (state)
 		pr_warn("Setting fan speed failed: %d\n", state);
@@ -1785,11 +4678,9 @@ static ssize_t pwm1_store(struct device *dev,
 	return count;
 }
 
-static ssize_t fan1_input_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+/* Fan speed in RPM as reported by the firmware */
+static int asus_wmi_fan_rpm(struct asus_wmi *asus, int *rpm)
 {
-	struct asus_wmi *asus = dev_get_drvdata(dev);
 	int value;
 	int ret;
 
@@ -1815,11 +4706,92 @@ static ssize_t fan1_input_show(struct device *dev,
 		}
 		break;
 
-	default:
-		return -ENXIO;
+	default:
+		return -ENXIO;
+	}
+
+	*rpm = value < 0 ? -1 : value * 100;
+	return 0;
+}
+
+/* The EC may update the two bytes between reads, so retry until stable */
+static int asus_ec_fan_rpm(struct asus_wmi *asus, int *rpm)
+{
+	u8 hi, lo, again;
+	int err, i;
+
+	err = ec_read(asus->ec_fan_rpm_reg, &hi);
+	for (i = 0; !err && i < ASUS_EC_FAN_RPM_TRIES; i++) {
+		err = ec_read(asus->ec_fan_rpm_reg + 1, &lo);
+		if (!err)
+			err = ec_read(asus->ec_fan_rpm_reg, &again);
+		if (err)
+			break;
+
+		if (again == hi) {
+			*rpm = (hi << 8) | lo;
+			return 0;
+		}
+		hi = again;
+	}
+
+	return err ? err : -EIO;
+}
+
+/*
+ * A stopped fan reads 0 from WMI and from any unused EC register alike,
+ * so the EC register is only trusted once it matched a spinning fan.
+ * Returns 0 once checked, or with the register dropped if it did not
+ * match, and -EAGAIN while the fan is stopped. *wmi_rpm is valid in all
+ * three cases; other errors come from the WMI read.
+ */
+static int asus_ec_fan_rpm_check(struct asus_wmi *asus, int *wmi_rpm)
+{
+	int ec_rpm, err;
+
+	err = asus_wmi_fan_rpm(asus, wmi_rpm);
+	if (err)
+		return err;
+
+	if (*wmi_rpm <= 0)
+		return -EAGAIN;
+
+	if (asus_ec_fan_rpm(asus, &ec_rpm) ||
+	    abs(ec_rpm - *wmi_rpm) > ASUS_EC_FAN_RPM_TOLERANCE) {
+		pr_info("EC fan speed does not match WMI, not using it\n");
+		asus->ec_fan_rpm_reg = -1;
+		return 0;
+	}
+
+	asus->ec_fan_rpm_checked = true;
+	return 0;
+}
+
+static ssize_t fan1_input_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	int value;
+	int ret;
+
+	if (asus->ec_fan_rpm_reg >= 0 && !asus->ec_fan_rpm_checked) {
+		/* The check has read the speed through WMI anyway */
+		ret = asus_ec_fan_rpm_check(asus, &value);
+		if (ret == -EAGAIN)
+			ret = 0;
+		goto out;
 	}
 
-	return sprintf(buf, "%d\n", value < 0 ? -1 : value*100);
+	if (asus->ec_fan_rpm_reg >= 0)
+		ret = asus_ec_fan_rpm(asus, &value);
+	else
+		ret = asus_wmi_fan_rpm(asus, &value);
+out:
+	if (ret)
+		return ret;
+
+	return sprintf(buf, "%d\n", value);
 }
 
 static ssize_t pwm1_enable_show(struct device *dev,
@@ -1867,7 +4839,7 @@ static ssize_t pwm1_enable_store(struct device *dev,
 			return -EINVAL;
 		}
 
-		ret = asus_wmi_set_devstate(ASUS_WMI_DEVID_CPU_FAN_CTRL,
+		ret = asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_CPU_FAN_CTRL,
 					    value, &retval);
 		if (ret)
 			return ret;
@@ -1901,20 +4873,49 @@ static ssize_t fan1_label_show(struct device *dev,
 	return sprintf(buf, "%s\n", ASUS_FAN_DESC);
 }
 
+/* CPU temperature in millidegrees Celsius as reported by the firmware */
+static int asus_wmi_cpu_temp(struct asus_wmi *asus, long *temp)
+{
+	u32 value;
+	int err;
+
+	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_THERMAL_CTRL, &value);
+	if (err < 0)
+		return err;
+
+	*temp = deci_kelvin_to_millicelsius(value & 0xFFFF);
+	return 0;
+}
+
+static int asus_ec_cpu_temp(struct asus_wmi *asus, long *temp)
+{
+	u8 value;
+	int err;
+
+	err = ec_read(asus->ec_cpu_temp_reg, &value);
+	if (err)
+		return err;
+
+	*temp = value * 1000L;
+	return 0;
+}
+
 static ssize_t asus_hwmon_temp1(struct device *dev,
 				struct device_attribute *attr,
 				char *buf)
 {
 	struct asus_wmi *asus = dev_get_drvdata(dev);
-	u32 value;
+	long value;
 	int err;
 
-	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_THERMAL_CTRL, &value);
+	if (asus->ec_cpu_temp_reg >= 0)
+		err = asus_ec_cpu_temp(asus, &value);
+	else
+		err = asus_wmi_cpu_temp(asus, &value);
 	if (err < 0)
 		return err;
 
-	return sprintf(buf, "%ld\n",
-		       deci_kelvin_to_millicelsius(value & 0xFFFF));
+	return sprintf(buf, "%ld\n", value);
 }
 
 /* Fan1 */
@@ -1941,7 +4942,7 @@ static umode_t asus_hwmon_sysfs_is_visible(struct kobject *kobj,
 {
 	struct device *dev = container_of(kobj, struct device, kobj);
 	struct asus_wmi *asus = dev_get_drvdata(dev->parent);
-	u32 value = ASUS_WMI_UNSUPPORTED_METHOD;
+	u32 value;
 
 	if (attr == &dev_attr_pwm1.attr) {
 		if (asus->fan_type != FAN_TYPE_AGFN)
@@ -1952,12 +4953,11 @@ static umode_t asus_hwmon_sysfs_is_visible(struct kobject *kobj,
 		if (asus->fan_type == FAN_TYPE_NONE)
 			return 0;
 	} else if (attr == &dev_attr_temp1_input.attr) {
-		int err = asus_wmi_get_devstate(asus,
-						ASUS_WMI_DEVID_THERMAL_CTRL,
-						&value);
+		if (!asus_wmi_dev_is_readable(asus, ASUS_WMI_DEVID_THERMAL_CTRL))
+			return 0;
 
-		if (err < 0)
-			return 0; /* can't return negative here */
+		value = asus_wmi_dev_probe_value(asus,
+						 ASUS_WMI_DEVID_THERMAL_CTRL);
 
 		/*
 		 * If the temperature value in deci-Kelvin is near the absolute
@@ -1967,46 +4967,517 @@ static umode_t asus_hwmon_sysfs_is_visible(struct kobject *kobj,
 			return 0;
 	}
 
-	return attr->mode;
-}
+	return attr->mode;
+}
+
+static const struct attribute_group hwmon_attribute_group = {
+	.is_visible = asus_hwmon_sysfs_is_visible,
+	.attrs = hwmon_attributes
+};
+__ATTRIBUTE_GROUPS(hwmon_attribute);
+
+static int asus_wmi_hwmon_init(struct asus_wmi *asus)
+{
+	struct device *dev = &asus->platform_device->dev;
+	struct device *hwmon;
+
+	hwmon = devm_hwmon_device_register_with_groups(dev, "asus", asus,
+			hwmon_attribute_groups);
+
+	if (IS_ERR(hwmon)) {
+		pr_err("Could not register asus hwmon device\n");
+		return PTR_ERR(hwmon);
+	}
+	return 0;
+}
+
+static int asus_wmi_fan_init(struct asus_wmi *asus)
+{
+	asus->fan_type = FAN_TYPE_NONE;
+	asus->agfn_pwm = -1;
+
+	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_CPU_FAN_CTRL)) {
+		asus->fan_type = FAN_TYPE_SPEC83;
+	} else {
+		asus_agfn_pool_init(asus);
+		if (asus_wmi_has_agfn_fan(asus))
+			asus->fan_type = FAN_TYPE_AGFN;
+		else
+			asus_agfn_pool_exit(asus);
+	}
+
+	if (asus->fan_type == FAN_TYPE_NONE)
+		return -ENODEV;
+
+	asus_fan_set_auto(asus);
+	asus->fan_pwm_mode = ASUS_FAN_CTRL_AUTO;
+	return 0;
+}
+
+/*
+ * Use the EC registers for hwmon readings, but only the ones that agree
+ * with what the firmware reports right now.
+ */
+static void asus_wmi_ec_init(struct asus_wmi *asus)
+{
+	const struct asus_ec_map *map = atw_ec_map;
+	long ec_temp, wmi_temp;
+	int wmi_rpm;
+
+	asus->ec_fan_rpm_reg = -1;
+	asus->ec_fan_rpm_checked = false;
+	asus->ec_cpu_temp_reg = -1;
+
+	if (!ec_fast_path)
+		return;
+
+	if (ec_fan_rpm_reg >= 0)
+		asus->ec_fan_rpm_reg = ec_fan_rpm_reg;
+	else if (map)
+		asus->ec_fan_rpm_reg = map->fan_rpm;
+
+	if (ec_cpu_temp_reg >= 0)
+		asus->ec_cpu_temp_reg = ec_cpu_temp_reg;
+	else if (map)
+		asus->ec_cpu_temp_reg = map->cpu_temp;
+
+	/* With the fan stopped, fan1_input checks again once it spins */
+	if (asus->ec_fan_rpm_reg >= 0)
+		asus_ec_fan_rpm_check(asus, &wmi_rpm);
+
+	if (asus->ec_cpu_temp_reg >= 0 &&
+	    (asus_wmi_cpu_temp(asus, &wmi_temp) ||
+	     asus_ec_cpu_temp(asus, &ec_temp) ||
+	     abs(ec_temp - wmi_temp) > ASUS_EC_TEMP_TOLERANCE)) {
+		pr_info("EC CPU temperature does not match WMI, not using it\n");
+		asus->ec_cpu_temp_reg = -1;
+	}
+}
+
+static void asus_wmi_fan_exit(struct asus_wmi *asus)
+{
+	asus_fan_set_auto(asus);
+	asus_agfn_pool_exit(asus);
+}
+
+/* RGB keyboard triggers ******************************************************/
+
+static const char * const kbbl_source_names[ASUS_KBBL_SOURCE_COUNT] = {
+	[ASUS_KBBL_SOURCE_NONE] = "none",
+	[ASUS_KBBL_SOURCE_CPUTEMP] = "cputemp",
+	[ASUS_KBBL_SOURCE_CPULOAD] = "cpuload",
+	[ASUS_KBBL_SOURCE_BATTERY] = "battery",
+};
+
+/* Green to red as the value gets worse */
+static const struct asus_kbbl_stop kbbl_source_gradients[][3] = {
+	[ASUS_KBBL_SOURCE_CPUTEMP] = {
+		{ 40, 0x00, 0xff, 0x00 },
+		{ 65, 0xff, 0xff, 0x00 },
+		{ 90, 0xff, 0x00, 0x00 },
+	},
+	[ASUS_KBBL_SOURCE_CPULOAD] = {
+		{ 0, 0x00, 0xff, 0x00 },
+		{ 50, 0xff, 0xff, 0x00 },
+		{ 100, 0xff, 0x00, 0x00 },
+	},
+	[ASUS_KBBL_SOURCE_BATTERY] = {
+		{ 10, 0xff, 0x00, 0x00 },
+		{ 40, 0xff, 0xff, 0x00 },
+		{ 80, 0x00, 0xff, 0x00 },
+	},
+};
+
+static int kbbl_source_cputemp(struct asus_wmi *asus, int *value)
+{
+	long temp;
+	int err;
+
+	if (asus->ec_cpu_temp_reg >= 0)
+		err = asus_ec_cpu_temp(asus, &temp);
+	else
+		err = asus_wmi_cpu_temp(asus, &temp);
+	if (err < 0)
+		return err;
+
+	*value = temp / 1000;
+	return 0;
+}
+
+/* Busy share of all CPUs since the last sample */
+static int kbbl_source_cpuload(struct asus_wmi *asus, int *value)
+{
+	struct asus_kbbl_trigger *trigger = &asus->kbbl_trigger;
+	u64 busy = 0, total = 0, cpu_busy;
+	u64 *stat;
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		stat = kcpustat_cpu(cpu).cpustat;
+		cpu_busy = stat[CPUTIME_USER] + stat[CPUTIME_NICE] +
+			   stat[CPUTIME_SYSTEM] + stat[CPUTIME_IRQ] +
+			   stat[CPUTIME_SOFTIRQ] + stat[CPUTIME_STEAL];
+		busy += cpu_busy;
+		total += cpu_busy + stat[CPUTIME_IDLE] + stat[CPUTIME_IOWAIT];
+	}
+
+	if (total <= trigger->cpu_total) {
+		trigger->cpu_busy = busy;
+		trigger->cpu_total = total;
+		return -EAGAIN;
+	}
+
+	*value = div64_u64((busy - trigger->cpu_busy) * 100,
+			   total - trigger->cpu_total);
+	trigger->cpu_busy = busy;
+	trigger->cpu_total = total;
+	return 0;
+}
+
+static int kbbl_source_battery(struct asus_wmi *asus, int *value)
+{
+	union power_supply_propval val;
+	struct power_supply *psy;
+	int err;
+
+	if (!asus->battery_name[0])
+		return -ENODEV;
+
+	psy = power_supply_get_by_name(asus->battery_name);
+	if (!psy)
+		return -ENODEV;
+
+	err = power_supply_get_property(psy, POWER_SUPPLY_PROP_CAPACITY, &val);
+	power_supply_put(psy);
+	if (err)
+		return err;
+
+	*value = val.intval;
+	return 0;
+}
+
+static u32 kbbl_gradient_color(const struct asus_kbbl_trigger *trigger,
+			       int value)
+{
+	const struct asus_kbbl_stop *a, *b;
+	int i, e;
+
+	a = &trigger->stop[0];
+	b = &trigger->stop[trigger->n - 1];
+	if (value <= a->value)
+		b = a;
+	else if (value >= b->value)
+		a = b;
+
+	for (i = 1; a != b && i < trigger->n; i++) {
+		if (value < trigger->stop[i].value) {
+			a = &trigger->stop[i - 1];
+			b = &trigger->stop[i];
+			break;
+		}
+	}
+
+	e = a == b ? 0 : (value - a->value) * 1024 / (b->value - a->value);
+
+	return kbbl_anim_mix(a->red, b->red, e) << 16 |
+	       kbbl_anim_mix(a->green, b->green, e) << 8 |
+	       kbbl_anim_mix(a->blue, b->blue, e);
+}
+
+/* 5 bits per channel, small steps of the source do not cause a commit */
+static u32 kbbl_quantize(u32 color)
+{
+	return (color & 0xf8f8f8) | ((color >> 5) & 0x070707);
+}
+
+static void kbbl_trigger_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     kbbl_trigger.work.work);
+	struct asus_kbbl_trigger *trigger = &asus->kbbl_trigger;
+	struct asus_kbbl_rgb *rgb = &asus->kbbl_rgb;
+	enum asus_kbbl_source source = READ_ONCE(rgb->source);
+	int value, err;
+	u32 color;
+
+	switch (source) {
+	case ASUS_KBBL_SOURCE_CPUTEMP:
+		err = kbbl_source_cputemp(asus, &value);
+		break;
+	case ASUS_KBBL_SOURCE_CPULOAD:
+		err = kbbl_source_cpuload(asus, &value);
+		break;
+	case ASUS_KBBL_SOURCE_BATTERY:
+		err = kbbl_source_battery(asus, &value);
+		break;
+	default:
+		return;
+	}
+
+	if (err || (trigger->have_value &&
+		    abs(value - trigger->value) < trigger->hysteresis))
+		goto next;
+
+	color = kbbl_quantize(kbbl_gradient_color(trigger, value));
+	trigger->value = value;
+
+	mutex_lock(&rgb->lock);
+	if (rgb->source != source) {
+		mutex_unlock(&rgb->lock);
+		return;
+	}
+
+	/* Unless the firmware state was lost, e.g. across resume */
+	if (trigger->have_value && color == trigger->color &&
+	    rgb->shown[ASUS_KBBL_RGB].valid) {
+		mutex_unlock(&rgb->lock);
+		goto next;
+	}
+
+	rgb->kbbl_set_red = color >> 16;
+	rgb->kbbl_set_green = color >> 8;
+	rgb->kbbl_set_blue = color;
+	rgb->kbbl_set_mode = 0;
+	if (!rgb->kbbl_set_flags)
+		rgb->kbbl_set_flags = ASUS_KBBL_FLAGS_DEFAULT;
+	err = __kbbl_rgb_write(asus, 0);
+	mutex_unlock(&rgb->lock);
+
+	if (!err) {
+		trigger->color = color;
+		trigger->have_value = true;
+	}
+
+next:
+	if (READ_ONCE(rgb->source) == source)
+		queue_delayed_work(system_freezable_wq, &trigger->work,
+				   msecs_to_jiffies(trigger->period_ms));
+}
+
+static ssize_t kbbl_trigger_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	enum asus_kbbl_source source = READ_ONCE(asus->kbbl_rgb.source);
+	int len = 0;
+	int i;
+
+	for (i = 0; i < ASUS_KBBL_SOURCE_COUNT; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 i == source ? "[%s] " : "%s ",
+				 kbbl_source_names[i]);
+	buf[len - 1] = '\n';
+
+	return len;
+}
+
+static ssize_t kbbl_trigger_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_trigger *trigger = &asus->kbbl_trigger;
+	int source, err;
+
+	source = sysfs_match_string(kbbl_source_names, buf);
+	if (source < 0)
+		return source;
+
+	/* Before anything is stopped, an open stream keeps the keyboard */
+	if (source != ASUS_KBBL_SOURCE_NONE) {
+		err = kbbl_anim_claim(asus);
+		if (err)
+			return err;
+	}
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	asus->kbbl_rgb.source = ASUS_KBBL_SOURCE_NONE;
+	mutex_unlock(&asus->kbbl_rgb.lock);
+	cancel_delayed_work_sync(&trigger->work);
+
+	if (source == ASUS_KBBL_SOURCE_NONE)
+		return count;
+
+	memcpy(trigger->stop, kbbl_source_gradients[source],
+	       sizeof(kbbl_source_gradients[source]));
+	trigger->n = ARRAY_SIZE(kbbl_source_gradients[source]);
+	trigger->have_value = false;
+	trigger->cpu_busy = 0;
+	trigger->cpu_total = 0;
+
+	mutex_lock(&asus->kbbl_rgb.lock);
+	if (asus->kbbl_stream.ring) {
+		mutex_unlock(&asus->kbbl_rgb.lock);
+		return -EBUSY;
+	}
+	asus->kbbl_rgb.source = source;
+	mutex_unlock(&asus->kbbl_rgb.lock);
+	queue_delayed_work(system_freezable_wq, &trigger->work, 0);
+
+	return count;
+}
+
+static ssize_t kbbl_trigger_gradient_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_trigger *trigger = &asus->kbbl_trigger;
+	int len = 0;
+	int i;
+
+	for (i = 0; i < trigger->n; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "%d:%02x%02x%02x ", trigger->stop[i].value,
+				 trigger->stop[i].red, trigger->stop[i].green,
+				 trigger->stop[i].blue);
+	len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+
+	return len;
+}
+
+static ssize_t kbbl_trigger_gradient_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	struct asus_kbbl_trigger *trigger = &asus->kbbl_trigger;
+	struct asus_kbbl_stop stop[ASUS_KBBL_GRADIENT_STOPS];
+	unsigned int color;
+	int n = 0, used;
+
+	while (*(buf = skip_spaces(buf))) {
+		if (n == ASUS_KBBL_GRADIENT_STOPS ||
+		    sscanf(buf, "%d:%6x%n", &stop[n].value, &color, &used) != 2)
+			return -EINVAL;
+		if (stop[n].value < ASUS_KBBL_GRADIENT_MIN ||
+		    stop[n].value > ASUS_KBBL_GRADIENT_MAX)
+			return -EINVAL;
+		if (n && stop[n].value <= stop[n - 1].value)
+			return -EINVAL;
+
+		stop[n].red = color >> 16;
+		stop[n].green = color >> 8;
+		stop[n].blue = color;
+		n++;
+		buf += used;
+	}
+	if (!n)
+		return -EINVAL;
+
+	/* Applied from the next sample on */
+	cancel_delayed_work_sync(&trigger->work);
+	memcpy(trigger->stop, stop, sizeof(stop[0]) * n);
+	trigger->n = n;
+	trigger->have_value = false;
+	if (READ_ONCE(asus->kbbl_rgb.source) != ASUS_KBBL_SOURCE_NONE)
+		queue_delayed_work(system_freezable_wq, &trigger->work, 0);
+
+	return count;
+}
+
+static ssize_t kbbl_trigger_period_ms_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", asus->kbbl_trigger.period_ms);
+}
+
+static ssize_t kbbl_trigger_period_ms_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	u32 value;
+	int err;
+
+	err = kstrtou32(buf, 10, &value);
+	if (err)
+		return err;
+
+	if (value < 100)
+		return -EINVAL;
+
+	asus->kbbl_trigger.period_ms = value;
+	return count;
+}
+
+static ssize_t kbbl_trigger_hysteresis_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", asus->kbbl_trigger.hysteresis);
+}
+
+static ssize_t kbbl_trigger_hysteresis_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	u32 value;
+	int err;
+
+	err = kstrtou32(buf, 10, &value);
+	if (err)
+		return err;
+
+	asus->kbbl_trigger.hysteresis = value;
+	return count;
+}
+
+/* Source of the colour: none, cputemp, cpuload or battery */
+static DEVICE_ATTR_RW(kbbl_trigger);
+
+/*
+ * Stops "value:RRGGBB ..." in ascending order, the colour is interpolated
+ * between them. Selecting a source loads its default gradient.
+ */
+static DEVICE_ATTR_RW(kbbl_trigger_gradient);
+
+/* How often the source is sampled, at least 100 */
+static DEVICE_ATTR_RW(kbbl_trigger_period_ms);
 
-static const struct attribute_group hwmon_attribute_group = {
-	.is_visible = asus_hwmon_sysfs_is_visible,
-	.attrs = hwmon_attributes
+/* Change of the source value needed before the colour follows */
+static DEVICE_ATTR_RW(kbbl_trigger_hysteresis);
+
+static struct attribute *kbbl_trigger_attributes[] = {
+	&dev_attr_kbbl_trigger.attr,
+	&dev_attr_kbbl_trigger_gradient.attr,
+	&dev_attr_kbbl_trigger_period_ms.attr,
+	&dev_attr_kbbl_trigger_hysteresis.attr,
+	NULL,
 };
-__ATTRIBUTE_GROUPS(hwmon_attribute);
 
-static int asus_wmi_hwmon_init(struct asus_wmi *asus)
+/* Merged into the kbbl group */
+static const struct attribute_group kbbl_trigger_attribute_group = {
+	.name = "kbbl",
+	.attrs = kbbl_trigger_attributes,
+};
+
+static int kbbl_trigger_init(struct asus_wmi *asus)
 {
-	struct device *dev = &asus->platform_device->dev;
-	struct device *hwmon;
+	struct asus_kbbl_trigger *trigger = &asus->kbbl_trigger;
 
-	hwmon = devm_hwmon_device_register_with_groups(dev, "asus", asus,
-			hwmon_attribute_groups);
+	INIT_DELAYED_WORK(&trigger->work, kbbl_trigger_work);
+	trigger->period_ms = 1000;
+	trigger->hysteresis = 2;
 
-	if (IS_ERR(hwmon)) {
-		pr_err("Could not register asus hwmon device\n");
-		return PTR_ERR(hwmon);
-	}
-	return 0;
+	if (!asus->kbbl_rgb_available)
+		return 0;
+
+	return sysfs_merge_group(&asus->platform_device->dev.kobj,
+				 &kbbl_trigger_attribute_group);
 }
 
-static int asus_wmi_fan_init(struct asus_wmi *asus)
+static void kbbl_trigger_exit(struct asus_wmi *asus)
 {
-	asus->fan_type = FAN_TYPE_NONE;
-	asus->agfn_pwm = -1;
-
-	if (asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_CPU_FAN_CTRL))
-		asus->fan_type = FAN_TYPE_SPEC83;
-	else if (asus_wmi_has_agfn_fan(asus))
-		asus->fan_type = FAN_TYPE_AGFN;
+	if (!asus->kbbl_rgb_available)
+		return;
 
-	if (asus->fan_type == FAN_TYPE_NONE)
-		return -ENODEV;
+	sysfs_unmerge_group(&asus->platform_device->dev.kobj,
+			    &kbbl_trigger_attribute_group);
 
-	asus_fan_set_auto(asus);
-	asus->fan_pwm_mode = ASUS_FAN_CTRL_AUTO;
-	return 0;
+	mutex_lock(&asus->kbbl_rgb.lock);
+	asus->kbbl_rgb.source = ASUS_KBBL_SOURCE_NONE;
+	mutex_unlock(&asus->kbbl_rgb.lock);
+	cancel_delayed_work_sync(&asus->kbbl_trigger.work);
 }
 
 /* Fan mode *******************************************************************/
@@ -2014,21 +5485,14 @@ static int asus_wmi_fan_init(struct asus_wmi *asus)
 static int fan_boost_mode_check_present(struct asus_wmi *asus)
 {
 	u32 result;
-	int err;
 
 	asus->fan_boost_mode_available = false;
 
-	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE,
-				    &result);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		else
-			return err;
-	}
+	if (!asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE))
+		return 0;
 
-	if ((result & ASUS_WMI_DSTS_PRESENCE_BIT) &&
-			(result & ASUS_FAN_BOOST_MODES_MASK)) {
+	result = asus_wmi_dev_probe_value(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE);
+	if (result & ASUS_FAN_BOOST_MODES_MASK) {
 		asus->fan_boost_mode_available = true;
 		asus->fan_boost_mode_mask = result & ASUS_FAN_BOOST_MODES_MASK;
 	}
@@ -2045,7 +5509,7 @@ static int fan_boost_mode_write(struct asus_wmi *asus)
 	value = asus->fan_boost_mode;
 
 	pr_info("Set fan boost mode: %u\n", value);
-	err = asus_wmi_set_devstate(ASUS_WMI_DEVID_FAN_BOOST_MODE, value,
+	err = asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE, value,
 				    &retval);
 
 	sysfs_notify(&asus->platform_device->dev.kobj, NULL,
@@ -2119,7 +5583,10 @@ static ssize_t fan_boost_mode_store(struct device *dev,
 	}
 
 	asus->fan_boost_mode = new_mode;
-	fan_boost_mode_write(asus);
+	if (async_writes)
+		asus_async_queue(asus, ASUS_ASYNC_FAN_BOOST_MODE, new_mode);
+	else
+		fan_boost_mode_write(asus);
 
 	return count;
 }
@@ -2131,22 +5598,9 @@ static DEVICE_ATTR_RW(fan_boost_mode);
 
 static int throttle_thermal_policy_check_present(struct asus_wmi *asus)
 {
-	u32 result;
-	int err;
-
-	asus->throttle_thermal_policy_available = false;
-
-	err = asus_wmi_get_devstate(asus,
-				    ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
-				    &result);
-	if (err) {
-		if (err == -ENODEV)
-			return 0;
-		return err;
-	}
-
-	if (result & ASUS_WMI_DSTS_PRESENCE_BIT)
-		asus->throttle_thermal_policy_available = true;
+	asus->throttle_thermal_policy_available =
+		asus_wmi_dev_is_present(asus,
+					ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY);
 
 	return 0;
 }
@@ -2159,7 +5613,8 @@ static int throttle_thermal_policy_write(struct asus_wmi *asus)
 
 	value = asus->throttle_thermal_policy_mode;
 
-	err = asus_wmi_set_devstate(ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
+	err = asus_wmi_set_devstate(asus,
+				    ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY,
 				    value, &retval);
 
 	sysfs_notify(&asus->platform_device->dev.kobj, NULL,
@@ -2224,7 +5679,11 @@ static ssize_t throttle_thermal_policy_store(struct device *dev,
 		return -EINVAL;
 
 	asus->throttle_thermal_policy_mode = new_mode;
-	throttle_thermal_policy_write(asus);
+	if (async_writes)
+		asus_async_queue(asus, ASUS_ASYNC_THROTTLE_THERMAL_POLICY,
+				 new_mode);
+	else
+		throttle_thermal_policy_write(asus);
 
 	return count;
 }
@@ -2274,6 +5733,9 @@ static int read_brightness(struct backlight_device *bd)
 	u32 retval;
 	int err;
 
+	if (asus_wmi_coalesce_pending(&asus->backlight_coalesce))
+		return bd->props.brightness;
+
 	err = asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_BRIGHTNESS, &retval);
 	if (err < 0)
 		return err;
@@ -2307,7 +5769,7 @@ static int update_bl_status(struct backlight_device *bd)
 	power = read_backlight_power(asus);
 	if (power != -ENODEV && bd->props.power != power) {
 		ctrl_param = !!(bd->props.power == FB_BLANK_UNBLANK);
-		err = asus_wmi_set_devstate(ASUS_WMI_DEVID_BACKLIGHT,
+		err = asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_BACKLIGHT,
 					    ctrl_param, NULL);
 		if (asus->driver->quirks->store_backlight_power)
 			asus->driver->panel_power = bd->props.power;
@@ -2323,7 +5785,7 @@ static int update_bl_status(struct backlight_device *bd)
 	else
 		ctrl_param = bd->props.brightness;
 
-	err = asus_wmi_set_devstate(ASUS_WMI_DEVID_BRIGHTNESS,
+	err = asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_BRIGHTNESS,
 				    ctrl_param, NULL);
 
 	return err;
@@ -2334,6 +5796,16 @@ static const struct backlight_ops asus_wmi_bl_ops = {
 	.update_status = update_bl_status,
 };
 
+static void backlight_coalesce_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     backlight_coalesce.work.work);
+	unsigned int seq = asus_wmi_coalesce_seq(&asus->backlight_coalesce);
+
+	backlight_update_status(asus->backlight_device);
+	asus_wmi_coalesce_end(&asus->backlight_coalesce, seq);
+}
+
 static int asus_wmi_backlight_notify(struct asus_wmi *asus, int code)
 {
 	struct backlight_device *bd = asus->backlight_device;
@@ -2346,7 +5818,11 @@ static int asus_wmi_backlight_notify(struct asus_wmi *asus, int code)
 		new = code - NOTIFY_BRNDOWN_MIN;
 
 	bd->props.brightness = new;
-	backlight_update_status(bd);
+
+	/* Scalar panels step once per write, every key press has to go out */
+	if (asus->driver->quirks->scalar_panel_brightness ||
+	    asus_wmi_coalesce_begin(&asus->backlight_coalesce))
+		backlight_update_status(bd);
 	backlight_force_update(bd, BACKLIGHT_UPDATE_HOTKEY);
 
 	return old;
@@ -2396,6 +5872,7 @@ static int asus_wmi_backlight_init(struct asus_wmi *asus)
 
 static void asus_wmi_backlight_exit(struct asus_wmi *asus)
 {
+	cancel_delayed_work_sync(&asus->backlight_coalesce.work);
 	backlight_device_unregister(asus->backlight_device);
 
 	asus->backlight_device = NULL;
@@ -2417,11 +5894,9 @@ static int is_display_toggle(int code)
 
 static bool asus_wmi_has_fnlock_key(struct asus_wmi *asus)
 {
-	u32 result;
-
-	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_FNLOCK, &result);
+	u32 result = asus_wmi_dev_probe_value(asus, ASUS_WMI_DEVID_FNLOCK);
 
-	return (result & ASUS_WMI_DSTS_PRESENCE_BIT) &&
+	return asus_wmi_dev_is_present(asus, ASUS_WMI_DEVID_FNLOCK) &&
 		!(result & ASUS_WMI_FNLOCK_BIOS_DISABLED);
 }
 
@@ -2429,44 +5904,196 @@ static void asus_wmi_fnlock_update(struct asus_wmi *asus)
 {
 	int mode = asus->fnlock_locked;
 
-	asus_wmi_set_devstate(ASUS_WMI_DEVID_FNLOCK, mode, NULL);
+	asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_FNLOCK, mode, NULL);
 }
 
 /* WMI events *****************************************************************/
 
-static int asus_wmi_get_event_code(u32 value)
+static int asus_wmi_get_event_code(struct asus_wmi *asus, u32 value)
 {
-	struct acpi_buffer response = { ACPI_ALLOCATE_BUFFER, NULL };
-	union acpi_object *obj;
+	struct acpi_buffer response = {
+		sizeof(asus->call_buf.obj), asus->call_buf.obj
+	};
 	acpi_status status;
-	int code;
+	u64 code;
+	int err;
+
+	asus_wmi_call_begin(asus, ASUS_WMI_PRIO_INTERACTIVE);
+
+	if (asus->call_buf.allocate)
+		response = (struct acpi_buffer) { ACPI_ALLOCATE_BUFFER, NULL };
 
 	status = wmi_get_event_data(value, &response);
-	if (ACPI_FAILURE(status)) {
+	if (ACPI_FAILURE(status) && status != AE_BUFFER_OVERFLOW) {
+		err = -EIO;
 		pr_warn("Failed to get WMI notify code: %s\n",
 				acpi_format_exception(status));
-		return -EIO;
+	} else {
+		err = asus_wmi_call_buf_decode(asus, &response, status, &code);
 	}
 
-	obj = (union acpi_object *)response.pointer;
+	if (response.pointer != asus->call_buf.obj)
+		kfree(response.pointer);
+	asus_wmi_call_end(asus);
 
-	if (obj && obj->type == ACPI_TYPE_INTEGER)
-		code = (int)(obj->integer.value & WMI_EVENT_MASK);
-	else
-		code = -EIO;
+	if (err)
+		return err;
 
-	kfree(obj);
+	return (int)(code & WMI_EVENT_MASK);
+}
+
+/*
+ * The firmware may have changed the state of a device on its own before
+ * sending the event, so drop the cached DSTS values that could be affected.
+ */
+static void asus_wmi_event_invalidate(struct asus_wmi *asus, int code)
+{
+	int i;
+
+	if (code >= NOTIFY_BRNUP_MIN && code <= NOTIFY_BRNDOWN_MAX) {
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_BRIGHTNESS);
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_BACKLIGHT);
+		return;
+	}
+
+	switch (code) {
+	case NOTIFY_KBD_BRTUP:
+	case NOTIFY_KBD_BRTDWN:
+	case NOTIFY_KBD_BRTTOGGLE:
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_KBD_BACKLIGHT);
+		break;
+	case NOTIFY_FNLOCK_TOGGLE:
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_FNLOCK);
+		break;
+	case NOTIFY_KBD_DOCK_CHANGE:
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_KBD_DOCK);
+		break;
+	case NOTIFY_LID_FLIP:
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_LID_FLIP);
+		break;
+	case NOTIFY_KBD_FBM:
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_FAN_BOOST_MODE);
+		break;
+	case NOTIFY_KBD_TTP:
+		asus_wmi_forget_state(asus,
+					 ASUS_WMI_DEVID_THROTTLE_THERMAL_POLICY);
+		break;
+	case 0x5D: /* Wireless console Toggle */
+	case 0x5E: /* Wireless console Enable */
+	case 0x5F: /* Wireless console Disable */
+	case 0x7D: /* Bluetooth Enable */
+	case 0x7E: /* Bluetooth Disable */
+	case 0x88: /* Radio Toggle Key */
+		for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+			if ((asus_wmi_devids[i].dev_id & 0xFFFF0000) ==
+			    (ASUS_WMI_DEVID_WLAN & 0xFFFF0000))
+				asus_wmi_forget_state(asus,
+						asus_wmi_devids[i].dev_id);
+		}
+		break;
+	case 0x60: /* Touchpad on */
+	case 0x6B: /* Touchpad toggle */
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_TOUCHPAD);
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_TOUCHPAD_LED);
+		break;
+	case 0x7A: /* Ambient Light Sensor Toggle */
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_ALS_ENABLE);
+		break;
+	case 0x82: /* Camera */
+		asus_wmi_forget_state(asus, ASUS_WMI_DEVID_CAMERA);
+		break;
+	}
+}
+
+static enum asus_wmi_event_action asus_wmi_event_action(struct asus_wmi *asus,
+							int code,
+							bool vendor_backlight)
+{
+	const struct quirk_entry *quirks = asus->driver->quirks;
+
+	if (code == ASUS_WMI_BRN_DOWN || code == ASUS_WMI_BRN_UP) {
+		if (vendor_backlight)
+			return ASUS_WMI_EVENT_BACKLIGHT;
+	}
+
+	switch (code) {
+	case NOTIFY_KBD_BRTUP:
+		return ASUS_WMI_EVENT_KBD_BRTUP;
+	case NOTIFY_KBD_BRTDWN:
+		return ASUS_WMI_EVENT_KBD_BRTDWN;
+	case NOTIFY_KBD_BRTTOGGLE:
+		return ASUS_WMI_EVENT_KBD_BRTTOGGLE;
+	case NOTIFY_FNLOCK_TOGGLE:
+		return ASUS_WMI_EVENT_FNLOCK;
+	case NOTIFY_KBD_DOCK_CHANGE:
+		if (quirks->use_kbd_dock_devid)
+			return ASUS_WMI_EVENT_KBD_DOCK;
+		break;
+	case NOTIFY_LID_FLIP:
+		if (quirks->use_lid_flip_devid)
+			return ASUS_WMI_EVENT_LID_FLIP;
+		break;
+	case NOTIFY_KBD_FBM:
+		if (asus->fan_boost_mode_available)
+			return ASUS_WMI_EVENT_FAN_BOOST_MODE;
+		break;
+	case NOTIFY_KBD_TTP:
+		if (asus->throttle_thermal_policy_available)
+			return ASUS_WMI_EVENT_THROTTLE_THERMAL_POLICY;
+		break;
+	}
+
+	if (is_display_toggle(code) && quirks->no_display_toggle)
+		return ASUS_WMI_EVENT_IGNORE;
+
+	return ASUS_WMI_EVENT_KEY;
+}
+
+/* All brightness notify codes map to one keymap entry each way */
+static int asus_wmi_key_code(int code)
+{
+	if (code >= NOTIFY_BRNUP_MIN && code <= NOTIFY_BRNUP_MAX)
+		return ASUS_WMI_BRN_UP;
+	if (code >= NOTIFY_BRNDOWN_MIN && code <= NOTIFY_BRNDOWN_MAX)
+		return ASUS_WMI_BRN_DOWN;
 	return code;
 }
 
+/*
+ * Must run once the keymap, the quirks and the backlight type are settled
+ * and the fan mode devices were probed.
+ */
+static void asus_wmi_dispatch_init(struct asus_wmi *asus)
+{
+	struct asus_wmi_dispatch *dispatch = &asus->dispatch;
+	bool vendor_backlight;
+	int code, key_code;
+
+	vendor_backlight =
+		acpi_video_get_backlight_type() == acpi_backlight_vendor;
+
+	for (code = 0; code < ASUS_WMI_DISPATCH_SIZE; code++) {
+		key_code = asus_wmi_key_code(code);
+
+		dispatch->action[code] = asus_wmi_event_action(asus, key_code,
+							       vendor_backlight);
+		dispatch->key[code] =
+			sparse_keymap_entry_from_scancode(asus->inputdev,
+							  key_code);
+	}
+}
+
 static void asus_wmi_handle_event_code(int code, struct asus_wmi *asus)
 {
+	const struct key_entry *ke = NULL;
 	unsigned int key_value = 1;
 	bool autorelease = 1;
 	int result, orig_code;
 
 	orig_code = code;
 
+	asus_wmi_event_invalidate(asus, code);
+
 	if (asus->driver->key_filter) {
 		asus->driver->key_filter(asus->driver, &code, &key_value,
 					 &autorelease);
@@ -2474,84 +6101,412 @@ static void asus_wmi_handle_event_code(int code, struct asus_wmi *asus)
 			return;
 	}
 
-	if (code >= NOTIFY_BRNUP_MIN && code <= NOTIFY_BRNUP_MAX)
-		code = ASUS_WMI_BRN_UP;
-	else if (code >= NOTIFY_BRNDOWN_MIN && code <= NOTIFY_BRNDOWN_MAX)
-		code = ASUS_WMI_BRN_DOWN;
+	if (code < 0 || code >= ASUS_WMI_DISPATCH_SIZE)
+		goto report;
 
-	if (code == ASUS_WMI_BRN_DOWN || code == ASUS_WMI_BRN_UP) {
-		if (acpi_video_get_backlight_type() == acpi_backlight_vendor) {
-			asus_wmi_backlight_notify(asus, orig_code);
-			return;
-		}
-	}
+	switch (asus->dispatch.action[code]) {
+	case ASUS_WMI_EVENT_IGNORE:
+		return;
+
+	case ASUS_WMI_EVENT_BACKLIGHT:
+		asus_wmi_backlight_notify(asus, orig_code);
+		return;
 
-	if (code == NOTIFY_KBD_BRTUP) {
+	case ASUS_WMI_EVENT_KBD_BRTUP:
 		kbd_led_set_by_kbd(asus, asus->kbd_led_wk + 1);
 		return;
-	}
-	if (code == NOTIFY_KBD_BRTDWN) {
+
+	case ASUS_WMI_EVENT_KBD_BRTDWN:
 		kbd_led_set_by_kbd(asus, asus->kbd_led_wk - 1);
 		return;
-	}
-	if (code == NOTIFY_KBD_BRTTOGGLE) {
+
+	case ASUS_WMI_EVENT_KBD_BRTTOGGLE:
 		if (asus->kbd_led_wk == asus->kbd_led.max_brightness)
 			kbd_led_set_by_kbd(asus, 0);
 		else
 			kbd_led_set_by_kbd(asus, asus->kbd_led_wk + 1);
 		return;
-	}
 
-	if (code == NOTIFY_FNLOCK_TOGGLE) {
+	case ASUS_WMI_EVENT_FNLOCK:
 		asus->fnlock_locked = !asus->fnlock_locked;
 		asus_wmi_fnlock_update(asus);
 		return;
-	}
 
-	if (asus->driver->quirks->use_kbd_dock_devid && code == NOTIFY_KBD_DOCK_CHANGE) {
+	case ASUS_WMI_EVENT_KBD_DOCK:
 		result = asus_wmi_get_devstate_simple(asus,
 						      ASUS_WMI_DEVID_KBD_DOCK);
 		if (result >= 0) {
+			asus_wmi_event_report_begin(asus);
 			input_report_switch(asus->inputdev, SW_TABLET_MODE,
 					    !result);
 			input_sync(asus->inputdev);
+			asus_wmi_event_report_end(asus);
 		}
 		return;
-	}
 
-	if (asus->driver->quirks->use_lid_flip_devid && code == NOTIFY_LID_FLIP) {
+	case ASUS_WMI_EVENT_LID_FLIP:
 		lid_flip_tablet_mode_get_state(asus);
 		return;
-	}
 
-	if (asus->fan_boost_mode_available && code == NOTIFY_KBD_FBM) {
+	case ASUS_WMI_EVENT_FAN_BOOST_MODE:
 		fan_boost_mode_switch_next(asus);
 		if (!report_key_events)
 			return;
-	}
+		break;
 
-	if (asus->throttle_thermal_policy_available && code == NOTIFY_KBD_TTP) {
+	case ASUS_WMI_EVENT_THROTTLE_THERMAL_POLICY:
 		throttle_thermal_policy_switch_next(asus);
 		if (!report_key_events)
 			return;
+		break;
+
+	case ASUS_WMI_EVENT_KEY:
+		break;
+	}
+
+	ke = asus->dispatch.key[code];
+
+report:
+	code = asus_wmi_key_code(code);
+	asus_wmi_event_report_begin(asus);
+	if (ke) {
+		sparse_keymap_report_entry(asus->inputdev, ke, key_value,
+					   autorelease);
+		asus_wmi_event_report_end(asus);
+	} else if (!sparse_keymap_report_event(asus->inputdev, code,
+					       key_value, autorelease)) {
+		pr_info("Unknown key %x pressed\n", code);
+	} else {
+		asus_wmi_event_report_end(asus);
+	}
+}
+
+/* Called with events.lock held, returns false if the ring was full */
+static bool __asus_wmi_queue_event(struct asus_wmi *asus, int code,
+				   ktime_t notified, ktime_t fetched,
+				   bool injected)
+{
+	struct asus_wmi_events *events = &asus->events;
+	struct asus_wmi_event_entry entry = {
+		.code = code,
+		.notified = notified,
+		.fetched = fetched,
+		.injected = injected,
+	};
+	unsigned int depth;
+
+	if (!kfifo_put(&events->ring, entry)) {
+		events->overflows++;
+		return false;
+	}
+
+	depth = kfifo_len(&events->ring);
+	if (depth > events->max_depth)
+		events->max_depth = depth;
+
+	queue_work(events->workqueue, &events->work);
+	return true;
+}
+
+static void asus_wmi_queue_event(struct asus_wmi *asus, int code,
+				 ktime_t notified, ktime_t fetched)
+{
+	struct asus_wmi_i8042 *i8042 = &asus->i8042;
+	unsigned long flags;
+
+	spin_lock_irqsave(&asus->events.lock, flags);
+	if (code >= 0 && code < ASUS_WMI_DISPATCH_SIZE &&
+	    i8042->expect[code]) {
+		i8042->expect[code]--;
+		if (time_before(jiffies, i8042->expect_end[code])) {
+			i8042->deduped++;
+			goto out;
+		}
+		i8042->expect[code] = 0;
+	}
+	__asus_wmi_queue_event(asus, code, notified, fetched, false);
+out:
+	spin_unlock_irqrestore(&asus->events.lock, flags);
+}
+
+/* Returns the WMI event code of a scancode, or -1 */
+static int asus_wmi_i8042_code(bool extended, unsigned char scancode)
+{
+	unsigned int prefix, entry;
+	int i;
+
+	for (i = 0; i < i8042_hotkeys_num; i++) {
+		entry = i8042_hotkeys[i];
+		prefix = (entry >> 16) & 0xff;
+
+		if (((entry >> 8) & 0xff) == scancode &&
+		    (prefix == 0xe0) == extended)
+			return entry & 0xff;
+	}
+
+	return -1;
+}
+
+/*
+ * Runs in the i8042 interrupt. Mapped keys are queued here and swallowed,
+ * make and break alike. The 0xe0 prefix has already gone to atkbd by the
+ * time the next byte tells which key it is, and atkbd would read the byte
+ * after a swallowed one as extended. So extended keys are queued early
+ * but passed on as well.
+ */
+static bool asus_wmi_i8042_filter(unsigned char data, unsigned char str,
+				  struct serio *port)
+{
+	struct asus_wmi *asus = asus_ref;
+	struct asus_wmi_i8042 *i8042;
+	unsigned long flags;
+	bool extended;
+	ktime_t now;
+	int code;
+
+	if (!asus || (str & I8042_STR_AUXDATA))
+		return false;
+
+	i8042 = &asus->i8042;
+	if (data == 0xe0) {
+		i8042->extended = true;
+		return false;
+	}
+
+	extended = i8042->extended;
+	i8042->extended = false;
+
+	code = asus_wmi_i8042_code(extended, data & 0x7f);
+	if (code < 0)
+		return false;
+
+	if (data & 0x80)
+		return !extended;
+
+	/* The scancode is the event code, there is nothing to fetch */
+	now = ktime_get();
+	spin_lock_irqsave(&asus->events.lock, flags);
+	if (i8042->expect[code] < U8_MAX)
+		i8042->expect[code]++;
+	i8042->expect_end[code] = jiffies +
+				  msecs_to_jiffies(ASUS_I8042_DEDUP_MS);
+	i8042->handled++;
+	__asus_wmi_queue_event(asus, code, now, now, false);
+	spin_unlock_irqrestore(&asus->events.lock, flags);
+
+	return !extended;
+}
+
+static void asus_wmi_i8042_init(struct asus_wmi *asus)
+{
+	int err;
+
+	if (!i8042_hotkeys_num)
+		return;
+
+	err = i8042_install_filter(asus_wmi_i8042_filter);
+	if (err) {
+		pr_warn("Unable to install key filter - %d\n", err);
+		return;
+	}
+
+	asus->driver->quirks->i8042_filter = asus_wmi_i8042_filter;
+}
+
+static void asus_wmi_i8042_exit(struct asus_wmi *asus)
+{
+	if (!asus->driver->quirks->i8042_filter)
+		return;
+
+	i8042_remove_filter(asus->driver->quirks->i8042_filter);
+	asus->driver->quirks->i8042_filter = NULL;
+}
+
+static void asus_wmi_event_lat_add(struct asus_wmi_event_lat *lat,
+				   enum asus_wmi_event_stage stage,
+				   ktime_t from, ktime_t to)
+{
+	s64 us = ktime_us_delta(to, from);
+
+	if (us < 0)
+		us = 0;
+	if (us > U32_MAX)
+		us = U32_MAX;
+
+	lat->sum_us[stage] += us;
+	if (us > lat->max_us[stage])
+		lat->max_us[stage] = us;
+
+	if (stage == ASUS_WMI_STAGE_HANDLE)
+		lat->hist[min_t(int, us ? ilog2(us) : 0,
+				ASUS_WMI_LAT_BUCKETS - 1)]++;
+}
+
+static void asus_wmi_event_account(struct asus_wmi *asus,
+				   const struct asus_wmi_event_entry *entry,
+				   ktime_t picked, ktime_t done)
+{
+	struct asus_wmi_events *events = &asus->events;
+	struct asus_wmi_event_lat *lat;
+
+	if (entry->code < 0 || entry->code >= ASUS_WMI_DISPATCH_SIZE)
+		return;
+
+	lat = &events->lat[entry->code];
+	lat->count++;
+	asus_wmi_event_lat_add(lat, ASUS_WMI_STAGE_FETCH, entry->notified,
+			       entry->fetched);
+	asus_wmi_event_lat_add(lat, ASUS_WMI_STAGE_QUEUE, entry->notified,
+			       picked);
+	asus_wmi_event_lat_add(lat, ASUS_WMI_STAGE_HANDLE, entry->notified,
+			       done);
+
+	if (events->reported) {
+		lat->reported++;
+		asus_wmi_event_lat_add(lat, ASUS_WMI_STAGE_REPORT,
+				       entry->notified, events->reported);
+	}
+}
+
+static void asus_wmi_inject_account(struct asus_wmi *asus,
+				    const struct asus_wmi_event_entry *entry,
+				    ktime_t done)
+{
+	struct asus_wmi_inject *inject = &asus->inject;
+	s64 us = ktime_us_delta(done, entry->notified);
+
+	inject->handled++;
+	inject->lat_sum_us += us;
+	if (us > inject->lat_max_us)
+		inject->lat_max_us = min_t(s64, us, U32_MAX);
+	inject->end = done;
+}
+
+static void asus_wmi_event_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     events.work);
+	struct asus_wmi_events *events = &asus->events;
+	struct asus_wmi_event_entry entry;
+	ktime_t picked, done;
+
+	/* WMI calls made while handling the event jump the queue */
+	asus->event_task = current;
+	while (kfifo_get(&events->ring, &entry)) {
+		picked = ktime_get();
+		events->cur = &entry;
+		events->reported = 0;
+
+		asus_wmi_handle_event_code(entry.code, asus);
+
+		/* Injected events never went through the firmware */
+		done = ktime_get();
+		if (entry.injected)
+			asus_wmi_inject_account(asus, &entry, done);
+		else
+			asus_wmi_event_account(asus, &entry, picked, done);
+		events->cur = NULL;
+	}
+	asus->event_task = NULL;
+}
+
+/*
+ * Event injection. Codes go through the same ring, worker and handler as
+ * firmware events, only the notify and _WED fetch are skipped.
+ */
+static void asus_wmi_inject_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     inject.work);
+	struct asus_wmi_inject *inject = &asus->inject;
+	u32 total = inject->count ? inject->count : inject->n;
+	unsigned long flags;
+	ktime_t now;
+	s64 ahead_us;
+	bool queued;
+	u32 i;
+
+	inject->start = ktime_get();
+
+	for (i = 0; i < total && !READ_ONCE(inject->stop); i++) {
+		if (inject->rate) {
+			ahead_us = div_u64((u64)i * USEC_PER_SEC, inject->rate) -
+				   ktime_us_delta(ktime_get(), inject->start);
+			if (ahead_us > 50)
+				usleep_range(ahead_us, ahead_us + 50);
+		} else if (!(i % 64)) {
+			cond_resched();
+		}
+
+		now = ktime_get();
+		spin_lock_irqsave(&asus->events.lock, flags);
+		queued = __asus_wmi_queue_event(asus,
+						inject->codes[i % inject->n],
+						now, now, true);
+		spin_unlock_irqrestore(&asus->events.lock, flags);
+
+		if (queued)
+			inject->sent++;
+		else
+			inject->dropped++;
+	}
+
+	flush_workqueue(asus->events.workqueue);
+	WRITE_ONCE(inject->running, false);
+}
+
+static void asus_wmi_inject_init(struct asus_wmi *asus)
+{
+	INIT_WORK(&asus->inject.work, asus_wmi_inject_work);
+	mutex_init(&asus->inject.lock);
+}
+
+/* Must run before the event ring goes away */
+static void asus_wmi_inject_exit(struct asus_wmi *asus)
+{
+	WRITE_ONCE(asus->inject.stop, true);
+	cancel_work_sync(&asus->inject.work);
+}
+
+static int asus_wmi_events_init(struct asus_wmi *asus)
+{
+	spin_lock_init(&asus->events.lock);
+	asus_wmi_inject_init(asus);
+	INIT_KFIFO(asus->events.ring);
+	INIT_WORK(&asus->events.work, asus_wmi_event_work);
+
+	asus->events.lat = kcalloc(ASUS_WMI_DISPATCH_SIZE,
+				   sizeof(*asus->events.lat), GFP_KERNEL);
+	if (!asus->events.lat)
+		return -ENOMEM;
+
+	asus->events.workqueue = alloc_ordered_workqueue("asus_wmi_events",
+							 WQ_HIGHPRI);
+	if (!asus->events.workqueue) {
+		kfree(asus->events.lat);
+		return -ENOMEM;
 	}
 
-	if (is_display_toggle(code) && asus->driver->quirks->no_display_toggle)
-		return;
+	return 0;
+}
 
-	if (!sparse_keymap_report_event(asus->inputdev, code,
-					key_value, autorelease))
-		pr_info("Unknown key %x pressed\n", code);
+static void asus_wmi_events_exit(struct asus_wmi *asus)
+{
+	destroy_workqueue(asus->events.workqueue);
+	kfree(asus->events.lat);
 }
 
 static void asus_wmi_notify(u32 value, void *context)
 {
 	struct asus_wmi *asus = context;
+	ktime_t notified = ktime_get();
+	ktime_t fetched;
 	int code;
 	int i;
 
 	for (i = 0; i < WMI_EVENT_QUEUE_SIZE + 1; i++) {
-		code = asus_wmi_get_event_code(value);
+		code = asus_wmi_get_event_code(asus, value);
+		fetched = ktime_get();
 		if (code < 0) {
 			pr_warn("Failed to get notify code: %d\n", code);
 			return;
@@ -2560,7 +6515,7 @@ static void asus_wmi_notify(u32 value, void *context)
 		if (code == WMI_EVENT_QUEUE_END || code == WMI_EVENT_MASK)
 			return;
 
-		asus_wmi_handle_event_code(code, asus);
+		asus_wmi_queue_event(asus, code, notified, fetched);
 
 		/*
 		 * Double check that queue is present:
@@ -2579,7 +6534,7 @@ static int asus_wmi_notify_queue_flush(struct asus_wmi *asus)
 	int i;
 
 	for (i = 0; i < WMI_EVENT_QUEUE_SIZE + 1; i++) {
-		code = asus_wmi_get_event_code(WMI_EVENT_VALUE_ATK);
+		code = asus_wmi_get_event_code(asus, WMI_EVENT_VALUE_ATK);
 		if (code < 0) {
 			pr_warn("Failed to get event during flush: %d\n", code);
 			return code;
@@ -2598,18 +6553,23 @@ static int asus_wmi_notify_queue_flush(struct asus_wmi *asus)
 static ssize_t store_sys_wmi(struct asus_wmi *asus, int devid,
 			     const char *buf, size_t count)
 {
+	int target = asus_async_target_of(devid);
 	u32 retval;
 	int err, value;
 
-	value = asus_wmi_get_devstate_simple(asus, devid);
-	if (value < 0)
-		return value;
+	if (!asus_wmi_dev_is_usable(asus, devid))
+		return -ENODEV;
 
 	err = kstrtoint(buf, 0, &value);
 	if (err)
 		return err;
 
-	err = asus_wmi_set_devstate(devid, value, &retval);
+	if (async_writes && target >= 0) {
+		asus_async_queue(asus, target, value);
+		return count;
+	}
+
+	err = asus_wmi_set_devstate(asus, devid, value, &retval);
 	if (err < 0)
 		return err;
 
@@ -2660,6 +6620,7 @@ ASUS_WMI_CREATE_DEVICE_ATTR(als_enable, 0644, ASUS_WMI_DEVID_ALS_ENABLE);
 static ssize_t cpufv_store(struct device *dev, struct device_attribute *attr,
 			   const char *buf, size_t count)
 {
+	struct asus_wmi *asus = dev_get_drvdata(dev);
 	int value, rv;
 
 	rv = kstrtoint(buf, 0, &value);
@@ -2669,7 +6630,8 @@ static ssize_t cpufv_store(struct device *dev, struct device_attribute *attr,
 	if (value < 0 || value > 2)
 		return -EINVAL;
 
-	rv = asus_wmi_evaluate_method(ASUS_WMI_METHODID_CFVS, value, 0, NULL);
+	rv = asus_wmi_evaluate_method(asus, ASUS_WMI_METHODID_CFVS,
+				      value, 0, NULL);
 	if (rv < 0)
 		return rv;
 
@@ -2714,7 +6676,7 @@ static umode_t asus_sysfs_is_visible(struct kobject *kobj,
 		ok = asus->throttle_thermal_policy_available;
 
 	if (devid != -1)
-		ok = !(asus_wmi_get_devstate_simple(asus, devid) < 0);
+		ok = asus_wmi_dev_is_usable(asus, devid);
 
 	return ok ? attr->mode : 0;
 }
@@ -2724,6 +6686,206 @@ static const struct attribute_group platform_attribute_group = {
 	.attrs = platform_attributes
 };
 
+static int asus_async_apply(struct asus_wmi *asus,
+			    enum asus_async_target target, int value)
+{
+	u32 retval;
+	int err;
+
+	switch (target) {
+	case ASUS_ASYNC_KBBL:
+		if (value != ASUS_KBBL_ASYNC_STATE)
+			return kbbl_rgb_write(asus, value == 1);
+
+		mutex_lock(&asus->kbbl_rgb.lock);
+		err = __kbbl_state_write(asus, &asus->kbbl_rgb.async_state);
+		mutex_unlock(&asus->kbbl_rgb.lock);
+		return err;
+
+	case ASUS_ASYNC_FAN_BOOST_MODE:
+		return fan_boost_mode_write(asus);
+
+	case ASUS_ASYNC_THROTTLE_THERMAL_POLICY:
+		return throttle_thermal_policy_write(asus);
+
+	case ASUS_ASYNC_PWM1:
+		err = asus_agfn_fan_speed_write(asus, 1, &value);
+		if (err)
+			pr_warn("Setting fan speed failed: %d\n", err);
+		else
+			asus->fan_pwm_mode = ASUS_FAN_CTRL_MANUAL;
+		return err;
+
+	default:
+		err = asus_wmi_set_devstate(asus, asus_async_devid[target],
+					    value, &retval);
+		/* DEVS returns 0 when the firmware rejects the value */
+		if (!err && !retval)
+			err = -EIO;
+		return err;
+	}
+}
+
+static void asus_async_work(struct work_struct *work)
+{
+	struct asus_wmi *asus = container_of(work, struct asus_wmi,
+					     async.work);
+	struct asus_async_slot *slot;
+	int i, value, err;
+	u32 seq;
+
+	for (i = 0; i < ASUS_ASYNC_COUNT; i++) {
+		slot = &asus->async.slot[i];
+
+		spin_lock(&asus->async.lock);
+		if (!slot->pending) {
+			spin_unlock(&asus->async.lock);
+			continue;
+		}
+		slot->pending = false;
+		value = slot->value;
+		seq = slot->queued;
+		spin_unlock(&asus->async.lock);
+
+		err = asus_async_apply(asus, i, value);
+
+		spin_lock(&asus->async.lock);
+		slot->done = seq;
+		slot->err = err;
+		spin_unlock(&asus->async.lock);
+	}
+}
+
+/* "<queued> <done> <err>": the store went through once done == queued */
+static ssize_t show_async_status(struct asus_wmi *asus,
+				 enum asus_async_target target, char *buf)
+{
+	struct asus_async_slot *slot = &asus->async.slot[target];
+	u32 queued, done;
+	int err;
+
+	spin_lock(&asus->async.lock);
+	queued = slot->queued;
+	done = slot->done;
+	err = slot->err;
+	spin_unlock(&asus->async.lock);
+
+	return sprintf(buf, "%u %u %d\n", queued, done, err);
+}
+
+#define ASUS_ASYNC_CREATE_STATUS_ATTR(_name, _target)			\
+	static ssize_t show_async_##_name(struct device *dev,		\
+					  struct device_attribute *attr,\
+					  char *buf)			\
+	{								\
+		struct asus_wmi *asus = dev_get_drvdata(dev);		\
+									\
+		return show_async_status(asus, _target, buf);		\
+	}								\
+	static struct device_attribute dev_attr_async_##_name = {	\
+		.attr = {						\
+			.name = __stringify(_name),			\
+			.mode = 0444 },					\
+		.show   = show_async_##_name,				\
+	}
+
+ASUS_ASYNC_CREATE_STATUS_ATTR(kbbl_set, ASUS_ASYNC_KBBL);
+ASUS_ASYNC_CREATE_STATUS_ATTR(fan_boost_mode, ASUS_ASYNC_FAN_BOOST_MODE);
+ASUS_ASYNC_CREATE_STATUS_ATTR(throttle_thermal_policy,
+			      ASUS_ASYNC_THROTTLE_THERMAL_POLICY);
+ASUS_ASYNC_CREATE_STATUS_ATTR(pwm1, ASUS_ASYNC_PWM1);
+ASUS_ASYNC_CREATE_STATUS_ATTR(touchpad, ASUS_ASYNC_TOUCHPAD);
+ASUS_ASYNC_CREATE_STATUS_ATTR(camera, ASUS_ASYNC_CAMERA);
+ASUS_ASYNC_CREATE_STATUS_ATTR(cardr, ASUS_ASYNC_CARDR);
+ASUS_ASYNC_CREATE_STATUS_ATTR(lid_resume, ASUS_ASYNC_LID_RESUME);
+ASUS_ASYNC_CREATE_STATUS_ATTR(als_enable, ASUS_ASYNC_ALS_ENABLE);
+
+static struct attribute *async_attributes[] = {
+	&dev_attr_async_kbbl_set.attr,
+	&dev_attr_async_fan_boost_mode.attr,
+	&dev_attr_async_throttle_thermal_policy.attr,
+	&dev_attr_async_pwm1.attr,
+	&dev_attr_async_touchpad.attr,
+	&dev_attr_async_camera.attr,
+	&dev_attr_async_cardr.attr,
+	&dev_attr_async_lid_resume.attr,
+	&dev_attr_async_als_enable.attr,
+	NULL
+};
+
+static umode_t asus_async_is_visible(struct kobject *kobj,
+				     struct attribute *attr, int idx)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct asus_wmi *asus = dev_get_drvdata(dev);
+	bool ok;
+
+	switch (idx) {
+	case ASUS_ASYNC_KBBL:
+		ok = asus->kbbl_rgb_available;
+		break;
+	case ASUS_ASYNC_FAN_BOOST_MODE:
+		ok = asus->fan_boost_mode_available;
+		break;
+	case ASUS_ASYNC_THROTTLE_THERMAL_POLICY:
+		ok = asus->throttle_thermal_policy_available;
+		break;
+	case ASUS_ASYNC_PWM1:
+		ok = asus->fan_type == FAN_TYPE_AGFN;
+		break;
+	default:
+		ok = asus_wmi_dev_is_usable(asus, asus_async_devid[idx]);
+		break;
+	}
+
+	return ok ? attr->mode : 0;
+}
+
+/* async_attributes[] is in asus_async_target order */
+static const struct attribute_group async_attribute_group = {
+	.name = "async",
+	.is_visible = asus_async_is_visible,
+	.attrs = async_attributes
+};
+
+/* The fan and the RGB keyboard are probed after the group was created */
+static void asus_async_update(struct asus_wmi *asus)
+{
+	if (sysfs_update_group(&asus->platform_device->dev.kobj,
+			       &async_attribute_group))
+		pr_warn("Failed to update async status files\n");
+}
+
+static void asus_async_exit(struct asus_wmi *asus)
+{
+	sysfs_remove_group(&asus->platform_device->dev.kobj,
+			   &async_attribute_group);
+	if (asus->async.workqueue)
+		destroy_workqueue(asus->async.workqueue);
+}
+
+static int asus_async_init(struct asus_wmi *asus)
+{
+	int err;
+
+	spin_lock_init(&asus->async.lock);
+	INIT_WORK(&asus->async.work, asus_async_work);
+
+	asus->async.workqueue =
+		create_singlethread_workqueue("async_workqueue");
+	if (!asus->async.workqueue)
+		return -ENOMEM;
+
+	err = sysfs_create_group(&asus->platform_device->dev.kobj,
+				 &async_attribute_group);
+	if (err) {
+		destroy_workqueue(asus->async.workqueue);
+		return err;
+	}
+
+	return 0;
+}
+
 static void asus_wmi_sysfs_exit(struct platform_device *device)
 {
 	sysfs_remove_group(&device->dev.kobj, &platform_attribute_group);
@@ -2742,11 +6904,11 @@ static int asus_wmi_platform_init(struct asus_wmi *asus)
 	int rv;
 
 	/* INIT enable hotkeys on some models */
-	if (!asus_wmi_evaluate_method(ASUS_WMI_METHODID_INIT, 0, 0, &rv))
+	if (!asus_wmi_evaluate_method(asus, ASUS_WMI_METHODID_INIT, 0, 0, &rv))
 		pr_info("Initialization: %#x\n", rv);
 
 	/* We don't know yet what to do with this version... */
-	if (!asus_wmi_evaluate_method(ASUS_WMI_METHODID_SPEC, 0, 0x9, &rv)) {
+	if (!asus_wmi_evaluate_method(asus, ASUS_WMI_METHODID_SPEC, 0, 0x9, &rv)) {
 		pr_info("BIOS WMI version: %d.%d\n", rv >> 16, rv & 0xFF);
 		asus->spec = rv;
 	}
@@ -2757,7 +6919,7 @@ static int asus_wmi_platform_init(struct asus_wmi *asus)
 	 * bit signifies that the laptop is equipped with a Wi-Fi MiniPCI card.
 	 * The significance of others is yet to be found.
 	 */
-	if (!asus_wmi_evaluate_method(ASUS_WMI_METHODID_SFUN, 0, 0, &rv)) {
+	if (!asus_wmi_evaluate_method(asus, ASUS_WMI_METHODID_SFUN, 0, 0, &rv)) {
 		pr_info("SFUN value: %#x\n", rv);
 		asus->sfun = rv;
 	}
@@ -2797,7 +6959,7 @@ static int asus_wmi_platform_init(struct asus_wmi *asus)
 	/* CWAP allow to define the behavior of the Fn+F2 key,
 	 * this method doesn't seems to be present on Eee PCs */
 	if (asus->driver->quirks->wapf >= 0)
-		asus_wmi_set_devstate(ASUS_WMI_DEVID_CWAP,
+		asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_CWAP,
 				      asus->driver->quirks->wapf, NULL);
 
 	return 0;
@@ -2817,7 +6979,8 @@ static int show_dsts(struct seq_file *m, void *data)
 	int err;
 	u32 retval = -1;
 
-	err = asus_wmi_get_devstate(asus, asus->debug.dev_id, &retval);
+	err = asus_wmi_evaluate_method(asus, asus->dsts_id, asus->debug.dev_id,
+				       0, &retval);
 	if (err < 0)
 		return err;
 
@@ -2832,8 +6995,8 @@ static int show_devs(struct seq_file *m, void *data)
 	int err;
 	u32 retval = -1;
 
-	err = asus_wmi_set_devstate(asus->debug.dev_id, asus->debug.ctrl_param,
-				    &retval);
+	err = asus_wmi_set_devstate_force(asus, asus->debug.dev_id,
+					  asus->debug.ctrl_param, &retval);
 	if (err < 0)
 		return err;
 
@@ -2855,9 +7018,9 @@ static int show_call(struct seq_file *m, void *data)
 	union acpi_object *obj;
 	acpi_status status;
 
-	status = wmi_evaluate_method(ASUS_WMI_MGMT_GUID,
-				     0, asus->debug.method_id,
-				     &input, &output);
+	status = wmidev_evaluate_method(atw_wmi_mgmt_dev,
+					0, asus->debug.method_id,
+					&input, &output);
 
 	if (ACPI_FAILURE(status))
 		return -EIO;
@@ -2877,10 +7040,141 @@ static int show_call(struct seq_file *m, void *data)
 	return 0;
 }
 
+static int show_devices(struct seq_file *m, void *data)
+{
+	struct asus_wmi *asus = m->private;
+	struct asus_wmi_devcaps *caps = &asus->caps;
+	int i;
+
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+		if (!test_bit(i, caps->readable))
+			continue;
+
+		seq_printf(m, "%#010x = %#010x%s%s\n", asus_wmi_devids[i].dev_id,
+			   caps->value[i],
+			   test_bit(i, caps->present) ? " present" : "",
+			   test_bit(i, caps->usable) ? " usable" : "");
+	}
+
+	return 0;
+}
+
+static int show_dsts_all(struct seq_file *m, void *data)
+{
+	struct asus_wmi *asus = m->private;
+	struct asus_wmi_call *calls;
+	int i, n = 0;
+
+	calls = kcalloc(ASUS_WMI_DEVID_COUNT, sizeof(*calls), GFP_KERNEL);
+	if (!calls)
+		return -ENOMEM;
+
+	for (i = 0; i < ASUS_WMI_DEVID_COUNT; i++) {
+		if (test_bit(i, asus->caps.readable))
+			calls[n++].dev_id = asus_wmi_devids[i].dev_id;
+	}
+
+	asus_wmi_get_devstate_batch(asus, calls, n);
+
+	for (i = 0; i < n; i++) {
+		if (calls[i].err)
+			seq_printf(m, "%#010x = %d\n", calls[i].dev_id,
+				   calls[i].err);
+		else
+			seq_printf(m, "%#010x = %#010x\n", calls[i].dev_id,
+				   calls[i].retval);
+	}
+
+	kfree(calls);
+	return 0;
+}
+
+static int show_sched(struct seq_file *m, void *data)
+{
+	static const char * const names[ASUS_WMI_PRIO_COUNT] = {
+		"interactive", "control", "background"
+	};
+	struct asus_wmi *asus = m->private;
+	struct asus_wmi_sched *sched = &asus->sched;
+	int i;
+
+	for (i = 0; i < ASUS_WMI_PRIO_COUNT; i++)
+		seq_printf(m, "%-12s calls %u waits %u max_wait_us %u\n",
+			   names[i], sched->calls[i], sched->waits[i],
+			   sched->max_wait_us[i]);
+
+	return 0;
+}
+
+static int show_event_latency(struct seq_file *m, void *data)
+{
+	static const char * const names[ASUS_WMI_STAGE_COUNT] = {
+		"fetch", "queue", "handle", "report"
+	};
+	struct asus_wmi *asus = m->private;
+	struct asus_wmi_event_lat *lat;
+	u32 n;
+	int code, i;
+
+	seq_puts(m, "# code count: stage avg/max us ...; handle histogram "
+		    "in log2 us buckets\n");
+
+	for (code = 0; code < ASUS_WMI_DISPATCH_SIZE; code++) {
+		lat = &asus->events.lat[code];
+		if (!lat->count)
+			continue;
+
+		seq_printf(m, "%#04x %u:", code, lat->count);
+		for (i = 0; i < ASUS_WMI_STAGE_COUNT; i++) {
+			n = i == ASUS_WMI_STAGE_REPORT ? lat->reported :
+							 lat->count;
+			if (!n)
+				continue;
+			seq_printf(m, " %s %llu/%u", names[i],
+				   div_u64(lat->sum_us[i], n), lat->max_us[i]);
+		}
+
+		seq_puts(m, "\n    ");
+		for (i = 0; i < ASUS_WMI_LAT_BUCKETS; i++)
+			seq_printf(m, " %u", lat->hist[i]);
+		seq_puts(m, "\n");
+	}
+
+	return 0;
+}
+
+static int show_inject(struct seq_file *m, void *data)
+{
+	struct asus_wmi *asus = m->private;
+	struct asus_wmi_inject *inject = &asus->inject;
+	ktime_t end = READ_ONCE(inject->running) ? ktime_get() : inject->end;
+	s64 elapsed_us = 0;
+
+	if (inject->handled)
+		elapsed_us = ktime_us_delta(end, inject->start);
+
+	seq_printf(m, "running %d sent %u dropped %u handled %u\n",
+		   READ_ONCE(inject->running), inject->sent, inject->dropped,
+		   inject->handled);
+	seq_printf(m, "elapsed_us %lld throughput %llu/s\n", elapsed_us,
+		   elapsed_us > 0 ? div_u64((u64)inject->handled *
+					    USEC_PER_SEC, elapsed_us) : 0);
+	seq_printf(m, "latency_us avg %llu max %u\n",
+		   inject->handled ? div_u64(inject->lat_sum_us,
+					     inject->handled) : 0,
+		   inject->lat_max_us);
+
+	return 0;
+}
+
 static struct asus_wmi_debugfs_node asus_wmi_debug_files[] = {
 	{NULL, "devs", show_devs},
 	{NULL, "dsts", show_dsts},
 	{NULL, "call", show_call},
+	{NULL, "devices", show_devices},
+	{NULL, "dsts_all", show_dsts_all},
+	{NULL, "sched", show_sched},
+	{NULL, "event_latency", show_event_latency},
 };
 
 static int asus_wmi_debugfs_open(struct inode *inode, struct file *file)
@@ -2898,6 +7192,76 @@ static const struct file_operations asus_wmi_debugfs_io_ops = {
 	.release = single_release,
 };
 
+static int asus_wmi_inject_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, show_inject, inode->i_private);
+}
+
+static ssize_t asus_wmi_inject_write(struct file *file,
+				     const char __user *ubuf,
+				     size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct asus_wmi *asus = m->private;
+	struct asus_wmi_inject *inject = &asus->inject;
+	int codes[ASUS_WMI_INJECT_MAX];
+	char buf[256], *p, *tok;
+	ssize_t len;
+	int code, n = 0;
+
+	len = simple_write_to_buffer(buf, sizeof(buf) - 1, ppos, ubuf, count);
+	if (len < 0)
+		return len;
+	buf[len] = '\0';
+	p = strim(buf);
+
+	if (sysfs_streq(p, "stop")) {
+		WRITE_ONCE(inject->stop, true);
+		return len;
+	}
+
+	while ((tok = strsep(&p, " \t,")) != NULL) {
+		if (!*tok)
+			continue;
+		if (n == ASUS_WMI_INJECT_MAX || kstrtoint(tok, 0, &code) ||
+		    code < 0 || code >= ASUS_WMI_DISPATCH_SIZE)
+			return -EINVAL;
+		codes[n++] = code;
+	}
+	if (!n)
+		return -EINVAL;
+
+	mutex_lock(&inject->lock);
+	if (READ_ONCE(inject->running)) {
+		mutex_unlock(&inject->lock);
+		return -EBUSY;
+	}
+
+	memcpy(inject->codes, codes, n * sizeof(*codes));
+	inject->n = n;
+	inject->stop = false;
+	inject->sent = 0;
+	inject->dropped = 0;
+	inject->handled = 0;
+	inject->lat_sum_us = 0;
+	inject->lat_max_us = 0;
+	inject->end = 0;
+	WRITE_ONCE(inject->running, true);
+	queue_work(system_unbound_wq, &inject->work);
+	mutex_unlock(&inject->lock);
+
+	return len;
+}
+
+static const struct file_operations asus_wmi_inject_ops = {
+	.owner = THIS_MODULE,
+	.open = asus_wmi_inject_open,
+	.read = seq_read,
+	.write = asus_wmi_inject_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static void asus_wmi_debugfs_exit(struct asus_wmi *asus)
 {
 	debugfs_remove_recursive(asus->debug.root);
@@ -2918,6 +7282,48 @@ static void asus_wmi_debugfs_init(struct asus_wmi *asus)
 	debugfs_create_x32("ctrl_param", S_IRUGO | S_IWUSR, asus->debug.root,
 			   &asus->debug.ctrl_param);
 
+	debugfs_create_u32("dsts_cache_hits", S_IRUGO, asus->debug.root,
+			   &asus->dsts_cache.hits);
+
+	debugfs_create_u32("dsts_cache_misses", S_IRUGO, asus->debug.root,
+			   &asus->dsts_cache.misses);
+
+	debugfs_create_u32("call_buf_overflows", S_IRUGO, asus->debug.root,
+			   &asus->call_buf.overflows);
+
+	debugfs_create_u32("devs_issued", S_IRUGO, asus->debug.root,
+			   &asus->devs_shadow.issued);
+
+	debugfs_create_u32("devs_skipped", S_IRUGO, asus->debug.root,
+			   &asus->devs_shadow.skipped);
+
+	debugfs_create_u32("event_ring_max_depth", S_IRUGO, asus->debug.root,
+			   &asus->events.max_depth);
+
+	debugfs_create_u32("event_ring_overflows", S_IRUGO, asus->debug.root,
+			   &asus->events.overflows);
+
+	debugfs_create_u32("i8042_handled", S_IRUGO, asus->debug.root,
+			   &asus->i8042.handled);
+
+	debugfs_create_u32("i8042_deduped", S_IRUGO, asus->debug.root,
+			   &asus->i8042.deduped);
+
+	debugfs_create_u32("kbbl_persistent_writes", S_IRUGO, asus->debug.root,
+			   &asus->kbbl_rgb.persistent_writes);
+
+	debugfs_create_u32("kbbl_temporary_writes", S_IRUGO, asus->debug.root,
+			   &asus->kbbl_rgb.temporary_writes);
+
+	debugfs_create_u32("inject_rate", S_IRUGO | S_IWUSR, asus->debug.root,
+			   &asus->inject.rate);
+
+	debugfs_create_u32("inject_count", S_IRUGO | S_IWUSR,
+			   asus->debug.root, &asus->inject.count);
+
+	debugfs_create_file("inject", S_IFREG | S_IRUGO | S_IWUSR,
+			    asus->debug.root, asus, &asus_wmi_inject_ops);
+
 	for (i = 0; i < ARRAY_SIZE(asus_wmi_debug_files); i++) {
 		struct asus_wmi_debugfs_node *node = &asus_wmi_debug_files[i];
 
@@ -3053,12 +7459,25 @@ static int asus_wmi_add(struct platform_device *pdev)
 	asus->platform_device = pdev;
 	asus->driver->platform_device = pdev;
 
+	spin_lock_init(&asus->dsts_cache.lock);
+	asus_wmi_devs_shadow_init(asus);
+	asus_wmi_coalesce_init(&asus->kbd_led_coalesce, kbd_led_coalesce_work);
+	asus_wmi_coalesce_init(&asus->backlight_coalesce,
+			       backlight_coalesce_work);
+	spin_lock_init(&asus->sched.lock);
+	init_waitqueue_head(&asus->sched.wq);
+
 	platform_set_drvdata(asus->platform_device, asus);
+	asus_ref = asus;
 
 	err = asus_wmi_platform_init(asus);
 	if (err)
 		goto fail_platform;
 
+	err = asus_wmi_probe_devices(asus);
+	if (err)
+		goto fail_platform;
+
 	err = fan_boost_mode_check_present(asus);
 	if (err)
 		goto fail_fan_boost_mode;
@@ -3069,6 +7488,10 @@ static int asus_wmi_add(struct platform_device *pdev)
 	else
 		throttle_thermal_policy_set_default(asus);
 
+	err = asus_async_init(asus);
+	if (err)
+		goto fail_async;
+
 	err = asus_wmi_sysfs_init(asus->platform_device);
 	if (err)
 		goto fail_sysfs;
@@ -3078,6 +7501,7 @@ static int asus_wmi_add(struct platform_device *pdev)
 		goto fail_input;
 
 	err = asus_wmi_fan_init(asus); /* probably no problems on error */
+	asus_wmi_ec_init(asus);
 
 	err = asus_wmi_hwmon_init(asus);
 	if (err)
@@ -3091,7 +7515,15 @@ static int asus_wmi_add(struct platform_device *pdev)
 	if (err)
 		goto fail_rgbkb;
 
-	asus_wmi_get_devstate(asus, ASUS_WMI_DEVID_WLAN, &result);
+	err = kbbl_trigger_init(asus);
+	if (err)
+		goto fail_kbbl_trigger;
+
+	asus_async_update(asus);
+
+	asus_wmi_idle_init(asus);
+
+	result = asus_wmi_dev_probe_value(asus, ASUS_WMI_DEVID_WLAN);
 	if (result & (ASUS_WMI_DSTS_PRESENCE_BIT | ASUS_WMI_DSTS_USER_BIT))
 		asus->driver->wlan_ctrl_by_user = 1;
 
@@ -3102,7 +7534,7 @@ static int asus_wmi_add(struct platform_device *pdev)
 	}
 
 	if (asus->driver->quirks->wmi_force_als_set)
-		asus_wmi_set_als();
+		asus_wmi_set_als(asus);
 
 	/* Some Asus desktop boards export an acpi-video backlight interface,
 	   stop this from showing up */
@@ -3124,13 +7556,20 @@ static int asus_wmi_add(struct platform_device *pdev)
 		if (err && err != -ENODEV)
 			goto fail_backlight;
 	} else if (asus->driver->quirks->wmi_backlight_set_devstate)
-		err = asus_wmi_set_devstate(ASUS_WMI_DEVID_BACKLIGHT, 2, NULL);
+		err = asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_BACKLIGHT, 2,
+					    NULL);
 
 	if (asus_wmi_has_fnlock_key(asus)) {
 		asus->fnlock_locked = true;
 		asus_wmi_fnlock_update(asus);
 	}
 
+	asus_wmi_dispatch_init(asus);
+
+	err = asus_wmi_events_init(asus);
+	if (err)
+		goto fail_events;
+
 	status = wmi_install_notify_handler(asus->driver->event_guid,
 					    asus_wmi_notify, asus);
 	if (ACPI_FAILURE(status)) {
@@ -3139,6 +7578,8 @@ static int asus_wmi_add(struct platform_device *pdev)
 		goto fail_wmi_handler;
 	}
 
+	asus_wmi_i8042_init(asus);
+
 	asus_wmi_battery_init(asus);
 
 	asus_wmi_debugfs_init(asus);
@@ -3146,22 +7587,31 @@ static int asus_wmi_add(struct platform_device *pdev)
 	return 0;
 
 fail_wmi_handler:
+	asus_wmi_events_exit(asus);
+fail_events:
 	asus_wmi_backlight_exit(asus);
 fail_backlight:
 	asus_wmi_rfkill_exit(asus);
 fail_rfkill:
+	asus_wmi_idle_exit(asus);
+	kbbl_trigger_exit(asus);
+fail_kbbl_trigger:
 	kbbl_rgb_exit(asus);
 fail_rgbkb:
 	asus_wmi_led_exit(asus);
 fail_leds:
 fail_hwmon:
+	asus_wmi_fan_exit(asus);
 	asus_wmi_input_exit(asus);
 fail_input:
 	asus_wmi_sysfs_exit(asus->platform_device);
 fail_sysfs:
+	asus_async_exit(asus);
+fail_async:
 fail_throttle_thermal_policy:
 fail_fan_boost_mode:
 fail_platform:
+	asus_ref = NULL;
 	kfree(asus);
 	return err;
 }
@@ -3171,17 +7621,25 @@ static int asus_wmi_remove(struct platform_device *device)
 	struct asus_wmi *asus;
 
 	asus = platform_get_drvdata(device);
+	/* debugfs can inject events, so it goes before the event rings */
+	asus_wmi_debugfs_exit(asus);
+	asus_wmi_i8042_exit(asus);
 	wmi_remove_notify_handler(asus->driver->event_guid);
+	asus_wmi_inject_exit(asus);
+	asus_wmi_events_exit(asus);
 	asus_wmi_backlight_exit(asus);
 	asus_wmi_input_exit(asus);
-	asus_wmi_led_exit(asus);
+	asus_wmi_idle_exit(asus);
+	kbbl_trigger_exit(asus);
 	kbbl_rgb_exit(asus);
+	asus_wmi_led_exit(asus);
 	asus_wmi_rfkill_exit(asus);
-	asus_wmi_debugfs_exit(asus);
 	asus_wmi_sysfs_exit(asus->platform_device);
-	asus_fan_set_auto(asus);
+	asus_async_exit(asus);
+	asus_wmi_fan_exit(asus);
 	asus_wmi_battery_exit(asus);
 
+	asus_ref = NULL;
 	kfree(asus);
 	return 0;
 }
@@ -3192,6 +7650,10 @@ static int asus_hotk_thaw(struct device *device)
 {
 	struct asus_wmi *asus = dev_get_drvdata(device);
 
+	asus_wmi_forget_all_state(asus);
+	asus_wmi_led_forget(asus);
+	kbbl_rgb_forget(asus);
+
 	if (asus->wlan.rfkill) {
 		bool wlan;
 
@@ -3201,7 +7663,7 @@ static int asus_hotk_thaw(struct device *device)
 		 * we should kick it ourselves in case hibernation is aborted.
 		 */
 		wlan = asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WLAN);
-		asus_wmi_set_devstate(ASUS_WMI_DEVID_WLAN, wlan, NULL);
+		asus_wmi_set_devstate(asus, ASUS_WMI_DEVID_WLAN, wlan, NULL);
 	}
 
 	return 0;
@@ -3211,6 +7673,10 @@ static int asus_hotk_resume(struct device *device)
 {
 	struct asus_wmi *asus = dev_get_drvdata(device);
 
+	asus_wmi_forget_all_state(asus);
+	asus_wmi_led_forget(asus);
+	kbbl_rgb_forget(asus);
+
 	if (!IS_ERR_OR_NULL(asus->kbd_led.dev))
 		kbd_led_update(asus);
 
@@ -3226,32 +7692,40 @@ static int asus_hotk_resume(struct device *device)
 static int asus_hotk_restore(struct device *device)
 {
 	struct asus_wmi *asus = dev_get_drvdata(device);
+	struct asus_rfkill *arfkill[] = {
+		&asus->bluetooth,
+		&asus->wimax,
+		&asus->wwan3g,
+		&asus->gps,
+		&asus->uwb,
+	};
+	struct asus_wmi_call calls[ARRAY_SIZE(arfkill)];
+	int i, n = 0;
 	int bl;
 
+	asus_wmi_forget_all_state(asus);
+	asus_wmi_led_forget(asus);
+	kbbl_rgb_forget(asus);
+
 	/* Refresh both wlan rfkill state and pci hotplug */
 	if (asus->wlan.rfkill)
 		asus_rfkill_hotplug(asus);
 
-	if (asus->bluetooth.rfkill) {
-		bl = !asus_wmi_get_devstate_simple(asus,
-						   ASUS_WMI_DEVID_BLUETOOTH);
-		rfkill_set_sw_state(asus->bluetooth.rfkill, bl);
-	}
-	if (asus->wimax.rfkill) {
-		bl = !asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WIMAX);
-		rfkill_set_sw_state(asus->wimax.rfkill, bl);
+	for (i = 0; i < ARRAY_SIZE(arfkill); i++) {
+		if (arfkill[i]->rfkill)
+			arfkill[n++] = arfkill[i];
 	}
-	if (asus->wwan3g.rfkill) {
-		bl = !asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_WWAN3G);
-		rfkill_set_sw_state(asus->wwan3g.rfkill, bl);
-	}
-	if (asus->gps.rfkill) {
-		bl = !asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_GPS);
-		rfkill_set_sw_state(asus->gps.rfkill, bl);
-	}
-	if (asus->uwb.rfkill) {
-		bl = !asus_wmi_get_devstate_simple(asus, ASUS_WMI_DEVID_UWB);
-		rfkill_set_sw_state(asus->uwb.rfkill, bl);
+
+	for (i = 0; i < n; i++)
+		calls[i].dev_id = arfkill[i]->dev_id;
+
+	asus_wmi_get_devstate_batch(asus, calls, n);
+
+	for (i = 0; i < n; i++) {
+		bl = calls[i].err ? calls[i].err :
+		     asus_wmi_devstate_bits(calls[i].retval,
+					    ASUS_WMI_DSTS_STATUS_BIT);
+		rfkill_set_sw_state(arfkill[i]->rfkill, !bl);
 	}
 	if (!IS_ERR_OR_NULL(asus->kbd_led.dev))
 		kbd_led_update(asus);
@@ -3265,7 +7739,20 @@ static int asus_hotk_restore(struct device *device)
 	return 0;
 }
 
+/* Settings waiting for kbbl_persist_delay_ms are saved before power goes */
+static int asus_hotk_suspend(struct device *device)
+{
+	struct asus_wmi *asus = dev_get_drvdata(device);
+
+	kbbl_persist_flush(asus);
+
+	return 0;
+}
+
 static const struct dev_pm_ops asus_pm_ops = {
+	.suspend = asus_hotk_suspend,
+	.freeze = asus_hotk_suspend,
+	.poweroff = asus_hotk_suspend,
 	.thaw = asus_hotk_thaw,
 	.restore = asus_hotk_restore,
 	.resume = asus_hotk_resume,
@@ -3276,9 +7763,17 @@ static struct platform_device* atw_platform_dev;
 
 // Platform driver ************************************************************
 
+static void asus_wmi_shutdown(struct platform_device *device)
+{
+	struct asus_wmi *asus = platform_get_drvdata(device);
+
+	kbbl_persist_flush(asus);
+}
+
 static struct platform_driver atw_platform_driver = {
 	.probe = asus_wmi_add,
 	.remove = asus_wmi_remove,
+	.shutdown = asus_wmi_shutdown,
 	.driver = {
 		.name = KBUILD_MODNAME,
 		.owner = THIS_MODULE,
@@ -3286,11 +7781,58 @@ static struct platform_driver atw_platform_driver = {
 	}
 };
 
+// WMI driver *****************************************************************
+
+/*
+ * Only the method GUID is bound. Events sent to a bound GUID go to the
+ * driver's notify callback instead of wmi_install_notify_handler(), whose
+ * callback we keep since its signature is stable across kernels.
+ */
+static const struct wmi_device_id atw_wmi_id_table[] = {
+	{ .guid_string = ASUS_WMI_MGMT_GUID },
+	{ }
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,2,0)
+static int atw_wmi_probe(struct wmi_device *wdev, const void *context)
+#else
+static int atw_wmi_probe(struct wmi_device *wdev)
+#endif
+{
+	atw_wmi_mgmt_dev = wdev;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
+static void atw_wmi_remove(struct wmi_device *wdev)
+#else
+static int atw_wmi_remove(struct wmi_device *wdev)
+#endif
+{
+	if (atw_wmi_mgmt_dev == wdev)
+		atw_wmi_mgmt_dev = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+
+	return 0;
+#endif
+}
+
+static struct wmi_driver atw_wmi_driver = {
+	.driver = {
+		.name = KBUILD_MODNAME "-wmi",
+	},
+	.id_table = atw_wmi_id_table,
+	.probe = atw_wmi_probe,
+	.remove = atw_wmi_remove,
+};
+
 // Probing ********************************************************************
 
 static int __init dmi_check_callback(const struct dmi_system_id *id)
 {
 	pr_info("DMI check: %s\n", id->ident);
+	atw_ec_map = id->driver_data;
 	return 1;
 }
 
@@ -3446,17 +7988,22 @@ static int __init atw_init(void)
 		pr_info("Omitting DMI verification\n");
 	}
 
-	if (!wmi_has_guid(ASUS_WMI_MGMT_GUID)) {
+	status = wmi_driver_register(&atw_wmi_driver);
+	if (status)
+		return status;
+
+	if (!atw_wmi_mgmt_dev) {
 		pr_info("Method WMI GUID not found\n");
-		return -ENODEV;
+		status = -ENODEV;
+		goto fail_wmi;
 	}
 
 	if (!wmi_has_guid(ASUS_NB_WMI_EVENT_GUID)) {
 		pr_info("Event WMI GUID not found\n");
-		return -ENODEV;
+		status = -ENODEV;
+		goto fail_wmi;
 	}
 
-
 	atw_platform_dev = platform_device_register_simple(
 			KBUILD_MODNAME, -1, NULL, 0);
 	if (IS_ERR(atw_platform_dev)) {
@@ -3475,6 +8022,8 @@ static int __init atw_init(void)
 fail_driver:
 	platform_device_unregister(atw_platform_dev);
 fail_dev:
+fail_wmi:
+	wmi_driver_unregister(&atw_wmi_driver);
 	return status;
 }
 
@@ -3483,6 +8032,7 @@ static void __exit atw_cleanup(void)
 	pr_info("Faustus unloading..");
 	platform_driver_unregister(&atw_platform_driver);
 	platform_device_unregister(atw_platform_dev);
+	wmi_driver_unregister(&atw_wmi_driver);
 }
  
 module_init(atw_init);
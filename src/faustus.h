@@ -137,6 +137,45 @@
 #define ASUS_WMI_BRN_DOWN	0x20
 #define ASUS_WMI_BRN_UP		0x2f
 
+/*
+ * Binary form of the kbbl/kbbl_state_raw attribute. Fields as in the
+ * single kbbl attributes; persist: 1 - permanently, 0 - until reboot.
+ */
+struct asus_kbbl_state {
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 mode;
+	__u8 speed;
+	__u8 flags;
+	__u8 persist;
+	__u8 reserved;
+};
+
+/*
+ * Page mmap()ed from /dev/faustus_kbbl. Userspace fills frame[head % N]
+ * and then increments head; the driver commits the newest frame at its own
+ * frame rate and skips the older ones.
+ */
+#define ASUS_KBBL_STREAM_FRAMES	64
+
+struct asus_kbbl_stream_frame {
+	__u8 red;
+	__u8 green;
+	__u8 blue;
+	__u8 reserved;
+};
+
+struct asus_kbbl_stream_ring {
+	__u32 head;		/* userspace: frames written */
+	__u32 tail;		/* driver: frames consumed */
+	__u32 frames;		/* driver: frames committed */
+	__u32 overruns;		/* driver: frames skipped for a newer one */
+	__u32 fps;		/* driver: frames committed in the last second */
+	__u32 reserved[3];
+	struct asus_kbbl_stream_frame frame[ASUS_KBBL_STREAM_FRAMES];
+};
+
 struct module;
 struct key_entry;
 struct asus_wmi;